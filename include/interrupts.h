@@ -12,21 +12,32 @@
 /**
  * @brief Receives data from USCIAB0 in UART mode.
  * The maskable interruptions will be turned off while this handler is
- * executing.It will record each character sent through UART on USCIAB0 in the
- * raw receiver buffer #rx_data_raw and it will call the validation function
- * #validate_str when a null terminator is received or when the buffer has
- * reached its limit.
+ * executing. It will store each character sent through UART on USCIAB0 in the
+ * receiver ring buffer #rx_ring, to be assembled in lines or binary frames
+ * by #read_line. Characters are dropped if the ring is full. If #uart_xonxoff
+ * is set, XOFF is sent when #RX_XOFF_LEVEL bytes are waiting.
  * @return Void.
  */
 void __attribute__ ((interrupt(USCIAB0RX_VECTOR))) received_data_ISR (void);
 
+/**
+ * @brief Transmits data through USCIAB0 in UART mode.
+ * Triggered when the USCI transmitter buffer is empty, it sends the pending
+ * XON/XOFF (#tx_flow) or the next byte of #tx_ring and disables itself when
+ * there is nothing left.
+ * @return Void.
+ */
+void __attribute__ ((interrupt(USCIAB0TX_VECTOR))) transmit_data_ISR (void);
+
 /**
  * @brief Detects edges on the configured pins on the Port1.
  * The endstops are connected in the PORT1 and are configured to trigger an
  * interruption through this ISR. It will deactivate all the maskable
  * interruptions while it is being executed. When an interruption is detected
- * the motors are stopped by clearing the TIMERA1 registers and blocking the
- * generation of the step output.
+ * the move is aborted (#stepper_abort) and the triggered endstops are latched
+ * in #end_hit, nothing is sent: #move reports them with the position given by
+ * the step counters. While homing (#home_axes) only the axes of the triggered
+ * endstops (SWX, SWY) are stopped, see #stepper_halt.
  * @return Void.
  */
 void __attribute__ ((interrupt(PORT1_VECTOR))) port1_ISR (void);
@@ -36,10 +47,41 @@ void __attribute__ ((interrupt(PORT1_VECTOR))) port1_ISR (void);
  * The endstops are connected in the PORT1 and are configured to trigger an
  * interruption through this ISR. It will deactivate all the maskable
  * interruptions while it is being executed. When an interruption is detected
- * the motors are stopped by clearing the TIMERA1 registers and blocking the
- * generation of the step output.
+ * the move is aborted (#stepper_abort) and the triggered endstop is latched
+ * in #end_hit, nothing is sent: #move reports it with the position given by
+ * the step counters. While homing (#home_axes) only the Z axis is stopped by
+ * its endstop (SWZ), see #stepper_halt.
  * @return Void.
  */
 void __attribute__ ((interrupt(PORT2_VECTOR))) port2_ISR (void);
 
+/**
+ * @brief Generates one step of the move described by #move_desc.
+ * Triggered by the Timer1_A3 CCR0 at the end of each step period. All axes are
+ * interpolated with Bresenham's line algorithm and the next period is given by
+ * the velocity profile (#ramp_next). After the last step the timer is stopped
+ * and #move_desc.busy is cleared. With #STEP_TIMER_OUTPUTS the X, Y and Z
+ * steps were made by the timer outputs at the event itself, the handler only
+ * reloads CCR0 to CCR2 and arms the outputs for the next event.
+ * @return Void.
+ */
+void __attribute__ ((interrupt(TIMER1_A0_VECTOR))) step_ISR (void);
+
+/**
+ * @brief Counts the auto-report interval.
+ * Triggered by the Timer0_A3 CCR0 every #REPORT_TICK_MS while the auto-report
+ * is enabled (#set_auto_report), the compare is moved one tick ahead each
+ * time. Sets #report_due when the interval has elapsed and wakes the CPU up,
+ * the report itself is sent by #auto_report in the main loop.
+ * @return Void.
+ */
+void __attribute__ ((interrupt(TIMER0_A0_VECTOR))) report_ISR (void);
+
+/**
+ * @brief Counts the Timer0_A3 overflows, the high word of #clock_cycles.
+ * Triggered every 65536 SMCLK cycles (8.192 ms) since #start_t0_a3_clock.
+ * @return Void.
+ */
+void __attribute__ ((interrupt(TIMER0_A1_VECTOR))) clock_ISR (void);
+
 #endif
@@ -0,0 +1,269 @@
+/**
+ * @file
+ * @brief Defines the motion planner: the queue of pre-parsed motion blocks and
+ * the trapezoidal velocity profile applied to every move.
+ * @author Davi Antônio da Silva Santos
+ */
+
+#ifndef PLANNER_H
+#define PLANNER_H
+
+/**
+ * @brief Absolute position in steps of the X, Y, Z axis and solder extruder.
+ */
+struct steps_pos {
+	long x;
+	long y;
+	long z;
+	long solder;
+};
+
+/**
+ * @brief Circular arc of a motion block (G2/G3) on the arc grid (see
+ * #ARC_STEPS_PER_MM), traced by #arc_next.
+ */
+struct block_arc {
+	/** Start point, relative to the center */
+	int x0;
+	int y0;
+	/** End point, relative to the center, not always on the circle */
+	int x1;
+	int y1;
+	/** Iterations of #arc_next from the start to the end (#arc_plan) */
+	unsigned long n;
+	/** One counterclockwise (G3), minus one clockwise (G2) */
+	signed char dir;
+};
+
+/**
+ * @brief Motion block: one G0/G1 move or G2/G3 arc converted to the step
+ * domain when it is parsed. The arc itself is not kept in the block, there is
+ * room for one queued arc only (#plan_arc).
+ */
+struct block {
+	/** Target position, absolute, the end of the arc for arcs */
+	struct steps_pos target;
+	/** C axis rotation, relative */
+	long rz;
+	/**
+	 * Cruise period of the dominant axis (of the arc iterations for
+	 * arcs), zero for the fastest (G0)
+	 */
+	unsigned int period;
+	/** One if X and Y trace the arc of #plan_arc, zero for straight moves */
+	char arc;
+};
+
+/**
+ * @brief Trapezoidal velocity profile state for one move.
+ *
+ * The periods are Timer1_A3 CCR0 values (SMCLK ticks) and are updated once per
+ * step of the dominant axis, using the integer approximation of the ramp
+ * described in Atmel AVR446 (c(n) = c(n-1) - 2*c(n-1)/(4n+1)).
+ */
+struct ramp {
+	/** Total number of steps of the dominant axis */
+	unsigned long steps;
+	/** Steps already performed */
+	unsigned long step;
+	/**
+	 * The deceleration starts after this step. Equal to #steps while
+	 * accelerating, never reached if the move starts at full speed.
+	 */
+	unsigned long decel_start;
+	/** Division remainder carried between steps to avoid drifting */
+	unsigned long rest;
+	/** Current period */
+	unsigned int period;
+	/** Cruise period (maximum speed) */
+	unsigned int min_period;
+};
+
+/**
+ * @brief Computes the acceleration/cruise/deceleration phases of a move.
+ * @param[out] r: profile to be initialised.
+ * @param[in] steps: number of steps of the dominant axis.
+ * @param[in] min_period: cruise period (see MIN_PULSE_PERIOD_* constants).
+ * @param[in] accel: acceleration of the dominant axis in steps/s^2.
+ * @return The period to be used for the first step.
+ */
+unsigned int ramp_init(struct ramp *r, unsigned long steps,
+		       unsigned int min_period, unsigned long accel);
+
+/**
+ * @brief Advances the profile by one step.
+ * @param[in,out] r: profile initialised by #ramp_init.
+ * @return The period to be used until the next step.
+ */
+unsigned int ramp_next(struct ramp *r);
+
+/**
+ * @brief Limits the dominant axis acceleration so that a slave axis does not
+ * exceed its own acceleration.
+ *
+ * A slave axis moving d_axis steps while the dominant axis moves d_dom steps
+ * accelerates d_axis/d_dom times as fast as the dominant one.
+ * @param[in] accel: current dominant axis acceleration in steps/s^2.
+ * @param[in] axis_accel: slave axis acceleration limit in steps/s^2.
+ * @param[in] d_dom: steps of the dominant axis.
+ * @param[in] d_axis: steps of the slave axis.
+ * @return The new dominant axis acceleration in steps/s^2.
+ */
+unsigned long limit_accel(unsigned long accel, unsigned long axis_accel,
+			  unsigned long d_dom, unsigned long d_axis);
+
+/**
+ * @brief Limits the dominant axis cruise period so that a slave axis does not
+ * step faster than its own maximum rate.
+ *
+ * A slave axis moving d_axis steps while the dominant axis moves d_dom steps
+ * has a mean period d_dom/d_axis times as long as the dominant one, but its
+ * steps may come only floor(d_dom/d_axis) dominant periods apart, which is
+ * the interval limited.
+ * @param[in] period: current dominant axis period (SMCLK ticks).
+ * @param[in] axis_period: slave axis smallest period (MIN_PULSE_PERIOD_*).
+ * @param[in] d_dom: steps of the dominant axis.
+ * @param[in] d_axis: steps of the slave axis, not larger than d_dom.
+ * @return The new dominant axis period.
+ */
+unsigned int limit_period(unsigned int period, unsigned int axis_period,
+			  unsigned long d_dom, unsigned long d_axis);
+
+/**
+ * @brief Computes the dominant axis period of a move at a feedrate, with
+ * integer arithmetic only.
+ *
+ * The feedrate applies to the X, Y and Z path length. Moves of the C axis
+ * and the solder extruder alone use the longest of both as the path length
+ * (degrees count as mm). The result is not limited by the axes maximum rates,
+ * #stepper_move does it.
+ *
+ * The X and Y path length of an arc is estimated from the iterations:
+ * #arc_next moves one or sqrt(2) grid steps per iteration, pi*sqrt(2)/4 on
+ * average over each octant. When the iterations are the dominant axis,
+ * #step_ISR stretches the period of the sqrt(2) ones (#ARC_DIAG_PERIOD), so
+ * the period returned is the one of a single grid step and the speed is kept
+ * within a few percent along the whole arc; otherwise it varies by about -10%
+ * and +27% between the axes and the 45 degrees points.
+ * @param[in] a: arc planned by #arc_plan, NULL for a straight move.
+ * @param[in,out] delta: relative move of each axis in steps, indexed by
+ * #axis_id, X and Y are ignored for an arc. Overwritten by the distances.
+ * @param[in] feed: feedrate in mm/min times #FEED_ONE.
+ * @return The dominant axis period (SMCLK ticks), the one of the arc
+ * iterations for an arc, 0xFFFF at most.
+ */
+unsigned int feed_period(const struct block_arc *a, long *delta, long feed);
+
+/**
+ * @brief Sets the start and end points of an arc relative to its center,
+ * given by its offset from the start (I and J words) or by its radius (R
+ * word). With a radius the center is the one on the left of the chord from the
+ * start to the end for counterclockwise arcs, on the right for clockwise ones,
+ * so the arc is at most half a circle; a negative radius selects the other
+ * center.
+ * @param[in,out] a: arc whose #block_arc.dir is set, the points are set.
+ * @param[in] start, end: start and end positions in steps, absolute, only X
+ * and Y are used.
+ * @param[in] i, j: center relative to the start in mm times #FIXED_ONE, used
+ * if r is #PARAM_NONE.
+ * @param[in] r: radius in mm times #FIXED_ONE or #PARAM_NONE.
+ * @return 0 on success, -1 if R is zero, a radius is larger than
+ * #ARC_MAX_RADIUS_MM or R is shorter than half of the chord.
+ */
+signed char arc_center(struct block_arc *a, const struct steps_pos *start,
+		       const struct steps_pos *end, long i, long j, long r);
+
+/**
+ * @brief Counts the iterations of #arc_next from the start to the end of an
+ * arc without tracing it: the major axis of each 45 degrees region steps once
+ * per iteration, so they are the distances along it from region to region,
+ * with the end moved to the circle. The count can be a few iterations off,
+ * #stepper_arc_next stops X and Y at the end and the steps left are moved in
+ * a line after the arc.
+ * @param[in,out] a: arc set by #arc_center, #block_arc.n is set.
+ * @return 0 on success, -1 if the end is more than #ARC_END_TOLERANCE grid
+ * points away from the circle.
+ */
+signed char arc_plan(struct block_arc *a);
+
+/**
+ * @brief Converts a fixed-point distance (see #get_word) to steps,
+ * truncating towards zero, with integer arithmetic only. The steps per unit
+ * must not exceed 4294 to keep the products inside 32 bits.
+ * @param[in] v: distance in mm (or degrees) times #FIXED_ONE.
+ * @param[in] steps_per_unit: steps per mm (or degree) of the axis.
+ * @return The distance in steps.
+ */
+long mm_to_steps(long v, unsigned int steps_per_unit);
+
+/**
+ * @brief Converts steps to a fixed-point distance (see #print_fixed), with
+ * integer arithmetic only. The steps per unit must not exceed 4294.
+ * @param[in] steps: distance in steps.
+ * @param[in] steps_per_unit: steps per mm (or degree) of the axis.
+ * @return The distance in mm (or degrees) times #FIXED_ONE.
+ */
+long steps_to_mm(long steps, unsigned int steps_per_unit);
+
+/**
+ * @brief Gets the free block after the end of the queue, to be filled in
+ * place and appended by #plan_push: a block is never copied from the stack.
+ * @return Pointer to the block or NULL if the queue is full.
+ */
+struct block *plan_free(void);
+
+/**
+ * @brief Gets the arc to be filled in place for the next arc block, see
+ * #plan_free.
+ * @return Pointer to the arc or NULL if an arc is already queued.
+ */
+struct block_arc *plan_arc_free(void);
+
+/**
+ * @brief Appends the block of #plan_free to the end of the queue.
+ * @param[in] arc: one if the block traces the arc of #plan_arc_free, which is
+ * kept as #plan_arc, zero for a straight move.
+ * @return 1 if the block was queued or 0 if the queue is full or an arc is
+ * already queued.
+ */
+char plan_push(char arc);
+
+/**
+ * @brief Gets the oldest block in the queue without removing it.
+ * @return Pointer to the block or NULL if the queue is empty.
+ */
+struct block *plan_peek(void);
+
+/**
+ * @brief Gets the newest block in the queue, the last one pushed.
+ * @return Pointer to the block or NULL if the queue is empty.
+ */
+struct block *plan_last(void);
+
+/**
+ * @brief Removes the oldest block from the queue.
+ * @return Void.
+ */
+void plan_pop(void);
+
+/**
+ * @brief Gets the arc of the queued arc block. Only one arc is kept, until it
+ * is started (#plan_arc_pop), so that the blocks do not carry its state.
+ * @return Pointer to the arc or NULL if no arc is queued.
+ */
+const struct block_arc *plan_arc(void);
+
+/**
+ * @brief Frees the arc of #plan_arc once it has been started, another arc can
+ * be queued.
+ * @return Void.
+ */
+void plan_arc_pop(void);
+
+/**
+ * @brief Number of blocks waiting in the queue.
+ * @return Blocks in the queue, from zero to #BLOCK_QUEUE_SIZE.
+ */
+unsigned char plan_count(void);
+
+#endif
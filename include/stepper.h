@@ -0,0 +1,276 @@
+/**
+ * @file
+ * @brief Defines the interrupt-driven step generator. One move of all axes is
+ * described by #move_desc and executed by #step_ISR, one step of the dominant
+ * axis per Timer1_A3 CCR0 event. The axes are described by the #axes table.
+ *
+ * With #STEP_TIMER_OUTPUTS the X, Y and Z step pins are driven by the
+ * Timer1_A3 outputs in toggle mode. Their Bresenham terms run one event ahead:
+ * #step_ISR arms (OUTMOD_4) or holds (OUTMOD_0) each output for the next
+ * event, whose edge then happens without any latency.
+ * @author Davi Antônio da Silva Santos
+ */
+
+#ifndef STEPPER_H
+#define STEPPER_H
+
+#include "sys_config.h"
+#include "planner.h"
+
+/** Axes indexes in #axes and in the arrays given to #stepper_move */
+enum axis_id {
+	AXIS_X,
+	AXIS_Y,
+	AXIS_Z,
+	/** Z axis rotation */
+	AXIS_C,
+	/** Solder extruder */
+	AXIS_E,
+	/** Number of axes interpolated together in one move */
+	DDA_AXES
+};
+
+/**
+ * @brief Fixed description of one axis: pins, directions and limits.
+ */
+struct axis_desc {
+	/** G-code letter */
+	char letter;
+	/** Output register of the step pin (P1OUT or P2OUT) */
+	volatile unsigned char *step_port;
+	/** Step pin mask */
+	unsigned char step_mask;
+	/** Output register of the direction pin */
+	volatile unsigned char *dir_port;
+	/** Direction pin mask */
+	unsigned char dir_mask;
+	/** Direction pin value for positive moves, #dir_mask or zero */
+	unsigned char dir_pos;
+	/** Steps per mm (or degree) */
+	unsigned int steps_per_unit;
+	/** Smallest step period, the maximum rate (MIN_PULSE_PERIOD_*) */
+	unsigned int min_period;
+	/** Acceleration in steps/s^2 (ACCEL_*) */
+	unsigned long accel;
+	/** Capture/compare control of the Timer1_A3 output on the step pin */
+	volatile unsigned int *step_cctl;
+};
+
+/**
+ * Axes stepped by the Timer1_A3 outputs (#STEP_TIMER_OUTPUTS), the first
+ * ones of #axis_id. The others are toggled by #step_ISR.
+ */
+#if STEP_TIMER_OUTPUTS
+#define STEP_HW_AXES (AXIS_Z + 1)
+#else
+#define STEP_HW_AXES (0)
+#endif
+
+/** Axes table, indexed by #axis_id */
+extern const struct axis_desc axes[DDA_AXES];
+
+/**
+ * @brief One axis of the move descriptor (Bresenham's line algorithm).
+ */
+struct dda_axis {
+	/** Steps of this axis */
+	long inc;
+	/**
+	 * Error term, the axis steps when it is not negative. It is half the
+	 * one of the original loops, the steps of the dominant axis
+	 * (#ramp.steps) are taken when stepping.
+	 */
+	long err;
+	/** Steps done since the start of the move, signed (#stepper_steps) */
+	long steps;
+};
+
+/** #arc_next: X steps */
+#define ARC_STEP_X (0x01)
+/** #arc_next: the X step is negative */
+#define ARC_NEG_X (0x02)
+/** #arc_next: Y steps */
+#define ARC_STEP_Y (0x04)
+/** #arc_next: the Y step is negative */
+#define ARC_NEG_Y (0x08)
+/** #arc_next: the end of the arc has been passed */
+#define ARC_END (0x10)
+/** #arc_next: both grid axes stepped, sqrt(2) grid steps were moved */
+#define ARC_DIAG (0x20)
+/**
+ * Period of an event whose iteration moved sqrt(2) grid steps (#ARC_DIAG),
+ * 1.40625 times the period of one grid step, 0xFFFF at most
+ */
+#define ARC_DIAG_PERIOD(p) (((p) <= 46602U) \
+			    ? (p) + ((p) >> 2) + ((p) >> 3) + ((p) >> 5) : 0xFFFF)
+
+/**
+ * @brief Arc generator state (#arc_next), set up by #arc_init.
+ */
+struct arc {
+	/** Point on the arc grid, relative to the center */
+	int x;
+	int y;
+	/** Distance to the circle, x^2 + y^2 - r^2 */
+	long e;
+	/** Cross product of the point and the end, positive before the end */
+	long c;
+	/** Change of #c per grid step of X and Y */
+	int cx;
+	int cy;
+	/** Rounding errors of the X and Y steps scaled from the grid */
+	int ex;
+	int ey;
+	/** One counterclockwise, minus one clockwise, zero for no arc */
+	signed char dir;
+	/**
+	 * #ARC_DIAG if the iterations are the dominant axis, their period is
+	 * stretched when they move sqrt(2) grid steps, zero otherwise
+	 */
+	unsigned char stretch;
+};
+
+/**
+ * @brief Per-move descriptor read by #step_ISR.
+ */
+struct move_desc {
+	/** Axes interpolated in this move, unused axes have no steps */
+	struct dda_axis axis[DDA_AXES];
+	/** Arc traced by X and Y instead of their Bresenham terms */
+	struct arc arc;
+	/**
+	 * Bresenham error of the arc iterations, Z, C or E can be dominant.
+	 * Its increment is the one of X, which is not changed by the arc.
+	 */
+	long arc_err;
+	/** Velocity profile */
+	struct ramp r;
+#if STEP_TIMER_OUTPUTS
+	/**
+	 * Timer output axes: TA1CCTLn value holding the output (OUTMOD_0) at
+	 * its level after the last armed step, OUT set when high
+	 */
+	unsigned int cctl[STEP_HW_AXES];
+#endif
+	/** Direction of the steps of each axis, 1 or -1 */
+	signed char dir[DDA_AXES];
+	/** One while the move is running, cleared by #step_ISR at the end */
+	volatile char busy;
+};
+
+/** Move being executed by #step_ISR */
+extern struct move_desc move_desc;
+
+/**
+ * @brief Step latency statistics: Timer1_A3 counts (SMCLK cycles) from the
+ * CCR0 event to the step pins write in #step_ISR. Interruptions running when
+ * the event happens delay the step. The Timer1_A3 outputs
+ * (#STEP_TIMER_OUTPUTS) are not delayed, but the latency still eats the time
+ * left to set up their next step.
+ */
+struct step_jitter {
+	/** Smallest latency */
+	unsigned int min;
+	/** Largest latency */
+	unsigned int max;
+	/** Steps per latency range, the last bin also counts longer latencies */
+	unsigned int hist[JITTER_BINS];
+};
+
+/** Latency of all steps since reset or the last #jitter_take */
+extern struct step_jitter step_jitter;
+
+/**
+ * @brief Copies and clears the step latency statistics.
+ * @param[out] j: statistics since the last call.
+ * @return Void.
+ */
+void jitter_take(struct step_jitter *j);
+
+/**
+ * @brief Starts moving all axes together and returns immediately, the
+ * completion is signalled by #stepper_busy. Must not be called while
+ * #stepper_busy.
+ *
+ * The directions are set from #axes, the axis with most steps is the dominant
+ * one and the others follow it through Bresenham's line algorithm. The cruise
+ * period and the acceleration are limited so that no axis exceeds its own
+ * #axis_desc.min_period and #axis_desc.accel.
+ * @param[in] delta: relative move of each axis in steps, indexed by #axis_id.
+ * @param[in] period: requested cruise period of the dominant axis.
+ * @return Void.
+ */
+void stepper_move(const long *delta, unsigned int period);
+
+/**
+ * @brief Starts an arc (G2/G3) and returns immediately, like #stepper_move.
+ *
+ * X and Y follow #arc_next, one iteration per Timer1_A3 CCR0 event, which is
+ * the dominant axis of the move: Z, C and E follow it through Bresenham's line
+ * algorithm (helices, solder along the arc). X and Y are limited as if they
+ * stepped on every iteration.
+ * @param[in] arc: arc planned by #arc_plan.
+ * @param[in] delta: relative move of each axis in steps, indexed by #axis_id,
+ * X and Y are ignored.
+ * @param[in] period: requested cruise period of the iterations.
+ * @return Void.
+ */
+void stepper_arc(const struct block_arc *arc, const long *delta,
+		 unsigned int period);
+
+/**
+ * @brief Sets up the arc generator at the start of an arc.
+ * @param[out] a: generator state.
+ * @param[in] b: arc set by #arc_center.
+ * @return Void.
+ */
+void arc_init(struct arc *a, const struct block_arc *b);
+
+/**
+ * @brief Runs one #arc_next iteration of the running arc and sets the X and Y
+ * direction pins and error terms for #step_ISR. Once the end of the arc is
+ * passed X and Y no longer step, the iterations left only move Z, C and E.
+ * @return Non-zero if the iteration moved sqrt(2) grid steps and the
+ * iterations are the dominant axis (#arc.stretch), the period of the event must
+ * be #ARC_DIAG_PERIOD, zero otherwise.
+ */
+unsigned char stepper_arc_next(void);
+
+/**
+ * @brief Checks if a move is running.
+ * @return 1 while the move started by #stepper_move runs, 0 otherwise.
+ */
+char stepper_busy(void);
+
+/**
+ * @brief Sleeps (#cpu_sleep) until the running move ends, if any.
+ * @return Void.
+ */
+void stepper_wait(void);
+
+/**
+ * @brief Stops the running move immediately. Safe to call from an ISR.
+ * @return Void.
+ */
+void stepper_abort(void);
+
+/**
+ * @brief Steps done by each axis since the start of the last move, exact
+ * after #stepper_abort and #stepper_halt: the steps armed on the Timer1_A3
+ * outputs and cancelled are not counted.
+ * @param[out] steps: signed steps, indexed by #axis_id.
+ * @return Void.
+ */
+void stepper_steps(long *steps);
+
+/**
+ * @brief Stops one axis of the running move, the other axes keep their rates
+ * and the move ends as planned. Must be called with the interruptions
+ * disabled (from an ISR, for instance). A step already armed on a Timer1_A3
+ * output is cancelled, unless its event has already happened.
+ * @param[in] axis: axis index (#axis_id).
+ * @return Void.
+ */
+void stepper_halt(unsigned char axis);
+
+#endif
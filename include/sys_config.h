@@ -64,10 +64,61 @@
 
 /* String buffers sizes in bytes */
 /** Size in bytes (characters) for the received string */
-#define RX_STR_SIZE (64)
-/** Size in bytes (characters) for the transmitted string */
+#define RX_STR_SIZE (48)
+/** Longest string sent at once by #send_string, in bytes (characters) */
 #define TX_STR_SIZE (64)
 
+/** Size in bytes of the UART receiver ring buffer, must be a power of two */
+#define RX_RING_SIZE (16)
+/** Size in bytes of the UART transmitter ring buffer, must be a power of two */
+#define TX_RING_SIZE (8)
+
+/** XOFF is sent when this many bytes are waiting in the receiver ring */
+#define RX_XOFF_LEVEL (RX_RING_SIZE / 2)
+/** XON is sent when the receiver ring has been emptied to this many bytes */
+#define RX_XON_LEVEL (4)
+/**
+ * Bytes a host acknowledged with "ok" (M14) may have sent and not
+ * acknowledged yet, the oldest line excluded: that one is in #rx_data_raw (or
+ * being moved there by #read_line) and the others wait in the receiver ring.
+ */
+#define RX_CREDIT_BYTES (RX_RING_SIZE - 1)
+
+/** UART baud rate after reset */
+#define UART_DEFAULT_BAUD (9600UL)
+/** Time the host has to confirm a new baud rate (see #change_baud_rate) */
+#define BAUD_CONFIRM_MS (2000)
+
+/**
+ * Number of motion blocks in the planner queue, must be a power of two. The
+ * planner does not look ahead, the block being moved and the next one are
+ * enough to start each move as soon as the previous one ends.
+ */
+#define BLOCK_QUEUE_SIZE (2)
+
+/** Auto-report tick period in ms (Timer0_A3, must fit in 16 bits of SMCLK) */
+#define REPORT_TICK_MS (5)
+
+/**
+ * Low power mode while idle: LPM0 stops MCLK (CPU) only. SMCLK must keep
+ * running for Timer0_A3, Timer1_A3 and the UART, and it comes from the DCO, so
+ * LPM1 would not save anything more.
+ */
+#define IDLE_LPM_BITS (LPM0_bits)
+
+/**
+ * One to step X, Y and Z with the Timer1_A3 outputs in toggle mode: P2.1 is
+ * TA1.1, P2.0 is TA1.0 and P2.5 is TA1.2, so the edges happen exactly at the
+ * timer events and #step_ISR only sets up the next one. Zero toggles them in
+ * software like C and E.
+ */
+#define STEP_TIMER_OUTPUTS (1)
+
+/** Bins of the step latency histogram (see #step_jitter) */
+#define JITTER_BINS (4)
+/** Each histogram bin is 2^JITTER_BIN_SHIFT SMCLK cycles wide (4 us) */
+#define JITTER_BIN_SHIFT (5)
+
 /* Helper macros for STEPS outputs */
 #define SET_STEPS_X (P2OUT |= STEPS_X)
 #define RESET_STEPS_X (P2OUT &= ~STEPS_X)
@@ -198,11 +249,59 @@
  */
 #define MIN_PULSE_PERIOD_ROT (1216-1)
 
+/* Homing (G33, see #calibrate) */
+/** The slow approach rate is the axis maximum rate divided by this */
+#define HOME_SLOW_DIV (4)
+/** Back-off between the fast and the slow approaches in mm */
+#define HOME_BACKOFF_MM (2)
+/** Distance from the endstops to the zero of X, Y and Z in mm */
+#define HOME_OFFSET_MM (5)
+/** The endstops are searched up to the axis length plus this in mm */
+#define HOME_MARGIN_MM (10)
+
+/** SMCLK frequency in Hz (see #initial_setup) */
+#define SMCLK_HZ (8000000UL)
+
+/**
+ * @brief First step period factor for the acceleration ramps.
+ * c0 = 0,676 * SMCLK * sqrt(2/a) = (0,956 * SMCLK) / sqrt(a), where a is the
+ * acceleration in steps/s^2 (see #ramp_init).
+ */
+#define RAMP_C0_FACTOR (SMCLK_HZ / 1000 * 956)
+
+/* Motors' accelerations in steps/s^2, all must be smaller than 65536 */
+
+/**
+ * @brief Y axis acceleration
+ * Reaches 20 RPM (2120 Hz, see #MIN_PULSE_PERIOD_YDIR) in 100 ms.
+ * The ramp starts at RAMP_C0_FACTOR / sqrt(ACCEL_Y) ~ 52700 SMCLK cycles
+ * (6,6 ms, 152 Hz) per step, well inside the pull-in torque.
+ */
+#define ACCEL_Y (21200UL)
+
+/**
+ * @brief X axis acceleration
+ * Reaches 37 RPM (3922 Hz, see #MIN_PULSE_PERIOD_XDIR) in 100 ms.
+ */
+#define ACCEL_X (39220UL)
+
+/**
+ * @brief Z axis acceleration
+ * Reaches 62 RPM (6572 Hz, see #MIN_PULSE_PERIOD_ZDIR) in 100 ms.
+ */
+#define ACCEL_Z (65000UL)
+
+/**
+ * @brief Solder extruder acceleration
+ * Same configurations as #ACCEL_Z
+ */
+#define ACCEL_SOLDER (ACCEL_Z)
+
 /**
- * @brief Max RPM for XYZ calibration routine. Speed of the slowest motor.
- * 20 RPM (see #MIN_PULSE_PERIOD_YDIR)
+ * @brief C axis acceleration
+ * Reaches 31 RPM (3286 Hz, see #MIN_PULSE_PERIOD_ROT) in 100 ms.
  */
-#define MIN_PULSE_CALIB_XYZ (MIN_PULSE_PERIOD_YDIR)
+#define ACCEL_ROT (32860UL)
 
 /* Motors' steps per mm constants */
 
@@ -221,17 +320,67 @@
 /** @brief C axis (RZ) steps per mm constant
  */
 #define STEPS_PER_DEG_RZ (36)
+/**
+ * @brief Steps per mm of the grid the arcs (G2/G3) are traced on, the finer
+ * of X and Y. The arc points are scaled from this grid to the X and Y steps.
+ */
+#define ARC_STEPS_PER_MM ((STEPS_PER_MM_X > STEPS_PER_MM_Y) \
+			  ? STEPS_PER_MM_X : STEPS_PER_MM_Y)
+/**
+ * @brief Largest arc radius in mm. The arc grid coordinates must fit in 16
+ * bits and their cross products in 31 bits, so at most 32767/#ARC_STEPS_PER_MM.
+ */
+#define ARC_MAX_RADIUS_MM (100)
+/**
+ * @brief Largest distance in arc grid points from the end of an arc to its
+ * circle. The rest is moved in a line after the arc.
+ */
+#define ARC_END_TOLERANCE (127)
+/**
+ * @brief Arcs of a smaller radius in arc grid points (25 um) are moved in a
+ * line to their end, they are shorter than the rounding of their center.
+ */
+#define ARC_MIN_RADIUS (8)
+
+/* Fixed-point numbers */
+/** Decimal places of the fixed-point numbers parsed from G/M-codes */
+#define FIXED_DIGITS (6)
+/** Fixed-point representation of one (mm, degree or code) */
+#define FIXED_ONE (1000000L)
+/** Decimal places of the reported positions, 1 um or 0,001 degree */
+#define REPORT_DIGITS (3)
+/** Decimal places of the feedrates (F word), mm/min times #FEED_ONE */
+#define FEED_DIGITS (2)
+/** Fixed-point representation of 1 mm/min */
+#define FEED_ONE (100L)
+/** G1 feedrate after reset, 400 mm/min (about the Y axis maximum rate) */
+#define DEFAULT_FEEDRATE (400L * FEED_ONE)
+/** Largest number parsed by #parse_line (2147,483647 mm) */
+#define PARAM_MAX (2147483647L)
+/** Returned by #get_word when the parameter is not in the line */
+#define PARAM_NONE (-2147483647L - 1)
+
+/* Stack */
+/** RAM of the MSP430G2553 in bytes */
+#define RAM_BYTES (512)
+/**
+ * RAM left to the stack, interruption handlers included: the variables may
+ * use the rest. It is the deepest call path (STACK_PATHS in the Makefile), an
+ * arc parsed while #step_ISR traces another one, and make ram checks both
+ * sides on the linked program.
+ */
+#define STACK_BYTES (172)
+/**
+ * Byte written over the free RAM at reset (#stack_paint), the bytes still
+ * holding it were never reached by the stack
+ */
+#define STACK_PAINT (0x5A)
+/** Bytes left unpainted below the stack pointer of #stack_paint */
+#define STACK_PAINT_GUARD (8)
 
 /* Global vars */
-/** Buffer to store raw data received by the UART */
-char rx_data_raw[RX_STR_SIZE];
-/** Buffer to send data though UART */
-char tx_data_raw[TX_STR_SIZE];
-/** Variable to store the requires steps/usteps for the desired movement */
-unsigned long int req_steps;
-
-/* Global variable to run all routines after parsing */
-volatile char execute_routine;
+/** Set by #read_line when a line is ready, cleared once it is evaluated */
+extern volatile char execute_routine;
 
 /**
  * @brief Initialises the system.
@@ -241,4 +390,20 @@ volatile char execute_routine;
  */
 void initial_setup(void);
 
+/**
+ * @brief Paints the RAM between the variables and the stack with
+ * #STACK_PAINT. Must be called first in main, with the interruptions
+ * disabled.
+ * @return Void.
+ */
+void stack_paint(void);
+
+/**
+ * @brief Measures the RAM between the variables and the top of the RAM.
+ * @param[out] used: bytes reached by the stack since #stack_paint, the
+ * high-water mark.
+ * @return Bytes never reached by the stack.
+ */
+unsigned int stack_free(unsigned int *used);
+
 #endif
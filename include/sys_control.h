@@ -8,44 +8,79 @@
 #ifndef FSM_CONTROL_H
 #define FSM_CONTROL_H
 
+#include "planner.h"
+#include "usart.h"
+
+/**
+ * @brief Machine status. Positions are kept in steps, Z max follows the
+ * solder routine flag.
+ */
 struct status {
-	float x;
-	float y;
-	float z;
-	float rz;
-	float solder;
+	/** X, Y, Z and solder extruder */
+	struct steps_pos pos;
+	long rz;
 
-	float zmax;
+	/**
+	 * Bits only written by the main loop: the endstop handlers write
+	 * #error and #end_triggd, whole bytes of their own
+	 */
+	unsigned char vacuum : 1;
+	unsigned char calibrated : 1;
+	unsigned char solder_routine : 1;
 
-	char vacuum;
-	char calibrated;
 	char error;
-	char solder_routine;
-
 	char end_triggd;
 };
 
-/** Maximum Z axis position in mm while in solder routine */
-const float max_z_solder;
-/** Maximum Z axis position in mm while in regular routine */
-const float max_z_component;
+/** Maximum Z axis position in mm while in solder routine (fixed-point) */
+extern const long max_z_solder;
+/** Maximum Z axis position in mm while in regular routine (fixed-point) */
+extern const long max_z_component;
 
-struct status curr_status;
-struct status req_status;
+/** Position and flags of the machine, once the moves are performed */
+extern struct status curr_status;
+
+/** Flags of the compact status (#status_compact) */
+#define STATUS_CAL (0x01)
+#define STATUS_ERR (0x02)
+#define STATUS_END (0x04)
+#define STATUS_VAC (0x08)
+#define STATUS_SDR (0x10)
+#define STATUS_RUN (0x20)
+
+/** Auto-report interval in #REPORT_TICK_MS ticks, zero if disabled */
+extern unsigned int report_ticks;
+/** Ticks left until the next auto-report, counted by #report_ISR */
+extern volatile unsigned int report_left;
+/** Set by #report_ISR when the auto-report is due */
+extern volatile char report_due;
+/**
+ * Axes seeking their endstops during #calibrate, bit n for #axis_id n. Each
+ * endstop handler clears the bit of its axis and stops it (#stepper_halt)
+ * instead of stopping the move. Zero outside #calibrate.
+ */
+extern volatile unsigned char home_axes;
+/**
+ * Endstops triggered out of #calibrate, bit n for #axis_id n. Set by the
+ * endstop handlers, which abort the move, and cleared by #move once the
+ * position is updated and reported.
+ */
+extern volatile unsigned char end_hit;
 
 /**
  * @brief Calibrates the machine sending it to the zero point in the X, Y and Z
  * axis.
  *
- * The calibration routine consists in:
- * Move X axis to the + endstop and to the - endstop.
- * Move Y axis to the + endstop and to the - endstop.
- * Move Z axis to the + endstop and to the - endstop.
- * If the wrong endstop is hit, return and set #curr_status.error and leave the
- * endstop flag set.
- *
- * The endstop flags are cleared individually if all proceeds as it has been
- * foreseen.
+ * The X, Y and Z axes are homed at the same time, each one at its own rate and
+ * stopped by its own endstop (see #home_axes):
+ * Move the axes to their - endstops at their maximum rates (fast approach).
+ * Back off #HOME_BACKOFF_MM.
+ * Move to the endstops again at 1/#HOME_SLOW_DIV of the maximum rates (slow
+ * approach), which sets the zeros.
+ * Back off #HOME_OFFSET_MM, the zero of the axes.
+ * Every move is ramped and timed by Timer1_A3 (#stepper_move). If an endstop
+ * is not found within the axis length plus #HOME_MARGIN_MM, the routine
+ * returns and sets #curr_status.error.
  *
  * Also, if the routine runs without errors, the positions are updated to zero
  * for X, Y, Z axis, the calibrated flag is set and the endstop triggered and
@@ -54,35 +89,184 @@ struct status req_status;
  */
 void calibrate();
 /**
- * @brief Moves the stepper motors (X, Y, Z, C/RZ and solder Extruder). Calls
- * #bresenham_3d, #move_rz and #move_solder.
+ * @brief Gets the end of the last queued move, the start of the next one: the
+ * target of the newest block (#plan_last), or the current position if the
+ * queue is empty.
+ * @return Pointer to the position in steps, absolute.
+ */
+const struct steps_pos *queued_pos(void);
+/**
+ * @brief Completes a motion block filled in place (#plan_free) and appends it
+ * to the planner queue. It starts where the last queued block ends
+ * (#queued_pos).
  *
- * If #curr_status.error is set no movement will be done and the machine will
+ * The cruise period is computed here from the feedrate (see #feed_period) and
+ * limited later by #stepper_move so that no axis exceeds its own rate. If
+ * #curr_status.error is set no block will be queued and the machine will
  * prompt for a calibration with #calibrate, issued by G33, or a manual
  * calibration performed by manually configuring the positions in milimeters
  * through G92.
+ * The caller must ensure there is room in the queue (see #plan_count), and
+ * for arcs that no other arc is queued (see #plan_arc).
+ * The iterations of arcs must have been counted by #arc_plan, which fails if
+ * their end is more than #ARC_END_TOLERANCE grid points away from the circle;
+ * the steps left at the end of the arc are moved in a line after it.
+ * @param[in,out] b: block of #plan_free whose #block.target (absolute) and
+ * #block.rz (relative) are set, the rest is set here.
+ * @param[in] feed: feedrate in mm/min times #FEED_ONE, zero for a rapid
+ * move (as fast as the axes allow).
+ * @param[in] arc: one if the block traces the arc of #plan_arc_free, set by
+ * #setup_arc and planned by #arc_plan, zero for a straight move.
+ * @return Void.
+ */
+void plan_move(struct block *b, long feed, char arc);
+/**
+ * @brief Checks the limits of a G0/G1 move (#BIN_MOVE) and queues it through
+ * #plan_move.
+ *
+ * X, Y and Z are limited to their maximum positions, reporting the limit. Z
+ * max depends on the solder routine.
+ * @param[in,out] b: block of #plan_free with the target position in steps
+ * (absolute, limited if needed) and the C axis rotation (relative).
+ * @param[in] solder: one if the solder extruder position was sent.
+ * @param[in] feed: feedrate in mm/min times #FEED_ONE, zero for G0.
+ * @return Void.
+ */
+void queue_move(struct block *b, char solder, long feed);
+/**
+ * @brief Checks the limits of a G2/G3 arc like #queue_move and finds its
+ * center (#arc_center), the caller counts its iterations (#arc_plan) and
+ * queues it through #plan_move, or sends "ARC?" if it is not valid. An arc
+ * whose radius is under #ARC_MIN_RADIUS grid points is queued as a line to
+ * its end.
+ * The arc is set in place too (#plan_arc_free).
+ * @param[in,out] b: block of #plan_free with the end position in steps
+ * (absolute, limited if needed) and the C axis rotation (relative).
+ * @param[in] solder: one if the solder extruder position was sent.
+ * @param[in] dir: one counterclockwise (G3), minus one clockwise (G2).
+ * @param[in] w: words of the line, I and J (center relative to the start)
+ * or R (radius) in mm.
+ * @return The arc argument of #plan_move: one for an arc, zero for a line,
+ * minus one if the arc is not valid and must not be queued.
+ */
+signed char setup_arc(struct block *b, char solder, signed char dir,
+		      const struct words *w);
+/**
+ * @brief Sets the current position (G92, #BIN_SET_POS) and clears the error
+ * flag.
+ * @param[in] pos: position in steps, absolute.
+ * @param[in] rz: C axis position in steps.
+ * @return Void.
+ */
+void set_position(const struct steps_pos *pos, long rz);
+/**
+ * @brief Turns the vacuum on or off (M10/M11, #BIN_VACUUM).
+ * @param[in] on: one to turn on, zero to turn off.
+ * @return Void.
+ */
+void set_vacuum(char on);
+/**
+ * @brief Moves the stepper motors (X, Y, Z, C/RZ and solder Extruder) to the
+ * oldest block in the planner queue. Must be polled by the main loop.
+ *
+ * Each call returns immediately: while the step generator (#step_ISR) is busy
+ * nothing is done, otherwise all axes of the block are started together
+ * through #stepper_move (#stepper_arc for arcs, followed by a line for the
+ * steps left to the target, if any). After the move #curr_status is updated,
+ * "done" is sent and the block is removed from the queue. The endstops
+ * interruptions are disabled while the C axis moves.
+ * After an endstop hit (#end_hit) the steps done until the move was aborted
+ * are added to #curr_status, "E H" and the letters of the triggered endstops
+ * are sent, and the blocks are discarded while #curr_status.error is set.
  * @return Void.
  */
 void move();
 /**
  * @brief Prints system status: X, Y, Z, E positions in milimeters; vacuum
  * status, calibration status and error status.
- * Calls #send_string and #print_float. The data is obtained through the struct
+ * Calls #send_string and #print_fixed. The data is obtained through the struct
  * #curr_status.
  * @return Void.
  */
 void status();
+/**
+ * @brief Prints the system status in a single line:
+ * <X:x|Y:y|Z:z|C:c|E:e|F:ff>
+ * The positions are in mm (degrees for C) and ff is the hexadecimal
+ * combination of the STATUS_* flags: calibrated, error, endstop triggered,
+ * vacuum, solder routine and moves pending. The data is obtained through the
+ * struct #curr_status.
+ * Calls #send_string and #print_fixed.
+ * @return Void.
+ */
+void status_compact();
+/**
+ * @brief Enables or disables the periodic compact status (#status_compact).
+ * The Timer0_A3 CCR0 interruption is only enabled while the auto-report is.
+ * @param[in] ms: interval in ms, rounded to #REPORT_TICK_MS, zero disables.
+ * @return Void.
+ */
+void set_auto_report(unsigned long ms);
+/**
+ * @brief Sends the compact status if the auto-report interval has elapsed
+ * (#report_due). Polled by the main loop, so the report never splits
+ * another reply.
+ * @return Void.
+ */
+void auto_report();
+/**
+ * @brief Prints the step latency statistics (#step_jitter) collected since
+ * the last report and clears them: smallest and largest latency and the
+ * histogram, one line per bin with its lower bound and its number of steps.
+ * All values are SMCLK cycles from the step timer event to the step pins.
+ * Calls #jitter_take, #send_string and #print_int.
+ * @return Void.
+ */
+void jitter_report();
+/**
+ * @brief Prints the share of time the CPU was awake since the last report,
+ * in percent with one decimal place, and starts a new window (#cpu_load).
+ * @return Void.
+ */
+void load_report();
+/**
+ * @brief Prints the stack high-water mark since reset and the RAM never
+ * reached by the stack, in bytes (#stack_free).
+ * @return Void.
+ */
+void stack_report();
+/**
+ * @brief Sleeps until an interruption if the main loop has nothing to do:
+ * no report due, no line to read or evaluate and no block to start. A line
+ * waiting for the queue is only evaluated again after a block is popped,
+ * which needs the running move to end. Called at the end of the main loop.
+ * @return Void.
+ */
+void sleep_idle();
 /**
  * @brief Validates and executes the command received by #received_data_ISR and
  * #rx_data_raw.
  * All the positions are precision limited to 6 decimal places and exponential
  * notation is not supported. Unit is fixed to milimeters in absolute mode.
+ * The line is split in words in a single pass by #parse_line (comments
+ * between parentheses are skipped) and a malformed line is answered with
+ * "PARSE?". The positions are converted to steps once, when parsed, using
+ * fixed-point arithmetic (see #get_word and #mm_to_steps).
  *
  * Recognized commands:
  *
  * G-codes
- * G0/G1 Xnnn Ynnn Znnn Cnnn Ennn
- *	Moves linearly to a specific point
+ * G0 Xnnn Ynnn Znnn Cnnn Ennn
+ *	Queues a rapid linear move (every axis limited to its maximum rate)
+ *	through #plan_move.
+ * G1 Xnnn Ynnn Znnn Cnnn Ennn Fnnn
+ *	Queues a linear move at the feedrate F in mm/min (modal, the last one
+ *	sent is kept) through #plan_move.
+ * G2/G3 Xnnn Ynnn Znnn Cnnn Ennn Innn Jnnn Fnnn (or Rnnn instead of I, J)
+ *	Queues a clockwise (G2) or counterclockwise (G3) arc in the XY plane
+ *	around the center at I, J from the start (or of radius R) through
+ *	#setup_arc, at the G1 feedrate. Z, C and E move along. Without X and Y
+ *	the arc is a whole circle.
  * G33
  *	Execute auto calibration routine through #calibrate.
  * G92 Xnnn Ynnn Cnnn Ennn
@@ -93,50 +277,54 @@ void status();
  *	Turn the vacuum on.
  * M11
  *	Turn the vacuum off.
- * M114
- *	Print system status through #status function.
- * If the command is unknown, return a message to the user.
- * Calls #parse_param, #move, #status, and #calibrate.
+ * M12
+ *	Echo the received characters (default).
+ * M13
+ *	Do not echo the received characters.
+ * M14
+ *	Acknowledge each line with "ok P<free blocks> B<free ring bytes>" once
+ *	it is buffered (moves) or performed (anything else), instead of "done"
+ *	once performed. The host may then keep up to #RX_CREDIT_BYTES bytes of
+ *	lines waiting besides the oldest one.
+ * M15
+ *	Acknowledge each line with "done" once performed (default).
+ * M114 S<0|1>
+ *	Print system status through #status function, or in a single line
+ *	through #status_compact if S1 is sent.
+ * M154 S<seconds>
+ *	Send the single line status every S seconds (0.005 resolution) through
+ *	#auto_report, S0 stops it. See #set_auto_report.
+ * M801
+ *	Print and clear the step timing statistics through #jitter_report.
+ * M802
+ *	Print and clear the CPU load through #load_report.
+ * M803
+ *	Print the stack high-water mark through #stack_report.
+ * M575 B<baud> S<0|1>
+ *	Switch to a new baud rate (9600, 19200, 38400, 57600 or 115200) and
+ *	turn the XON/XOFF flow control on (S1) or off (S0). "done" is sent at
+ *	the previous rate, see #change_baud_rate.
+ * If the command is unknown, return a message to the user. Binary frames are
+ * not parsed here, the main loop hands them to #eval_binary.
+ *
+ * Moves are only parsed if there is room in the planner queue and any other
+ * command is only executed after the queue is empty. Otherwise the function
+ * returns and keeps #execute_routine set, so the line is evaluated again.
+ * Calls #parse_line, #plan_move, #move, #status, and #calibrate.
  * @return Void.
  */
 void eval_command();
 /**
- * @brief Moves solder extruder to a desired position. Positive is downwards in
- * millimeters. Maximum of 53 mm. No boundary checks are performed.
- * @param[in] p1: Initial position in mm, absolute.
- * @param[in] p2 Desired position in mm, absolute.
- * @param[in] period: Frequency of stepper motor pulses.
- * @return Void.
- */
-void move_solder(float p1, float p2, unsigned int period);
-/**
- * @brief Moves the needle in the C axis (Z axis rotation). Positive is
- * clockwise in degrees and it is the only accepted direction.
- * @param[in] p1: Initial position in mm, absolute.
- * @param[in] p2: Desired position in mm, absolute.
- * @param[in] period: Frequency of stepper motor pulses.
- * @return Void.
- */
-void move_rz(float p1, float p2, unsigned int period);
-/**
- * @brief Moves the system in the X, Y and Z axis. X is positive to the left, Y
- * is positive backwards and Z is positive downwards.
- * Maximum distance in X axis: 298 mm.
- * Maximum distance in Y axis: 369 mm.
- * Maximum distance in Z axis: 53,2 mm (solder) or 64,41 mm (component).
- * Boundary checks are only performed for Z axis because there is no endstop in
- * its positive direction, only in the negative.
- * @param[in] x1: Initial position in mm, absolute.
- * @param[in] y1: Initial position in mm, absolute.
- * @param[in] z1: Initial position in mm, absolute.
- * @param[in] x2: Desired position in mm, absolute.
- * @param[in] y2: Desired position in mm, absolute.
- * @param[in] z2: Desired position in mm, absolute.
- * @param[in] period: Frequency of stepper motor pulses.
+ * @brief Validates and executes the binary frame in #rx_data_raw (see
+ * #BIN_SOF). Called instead of #eval_command while #rx_binary is set.
+ *
+ * The CRC is checked and the command is dispatched to the same handlers as
+ * #eval_command (#queue_move, #calibrate, #set_position, #set_vacuum and
+ * #status), after replying with a #BIN_ACK frame. A #BIN_NAK frame is sent
+ * for CRC errors, unknown commands or wrong payloads. The planner queue rules
+ * of #eval_command also apply.
  * @return Void.
  */
-void bresenham_3d(float x1, float y1, float z1,
-		  float x2, float y2, float z2,
-		  unsigned int period);
+void eval_binary();
 
 #endif
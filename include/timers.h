@@ -10,16 +10,85 @@
 #include <msp430.h>
 
 /**
- * @brief Starts the Timer A3 CCR0 and enable its interruption.
+ * @brief Starts the Timer A3 CCR0. The end of each period must be polled
+ * through TAIFG.
  * @param[in] period The timer period (beware the used clock).
  * @return Void.
  */
 void start_t1_a3_c0(unsigned int period);
 
+/**
+ * @brief Starts the Timer A3 CCR0 and enable its interruption (#step_ISR).
+ * CCR1 and CCR2 get the same period, so the TA1.1 and TA1.2 outputs toggle
+ * together with TA1.0; the TA1.0 output mode is kept.
+ * @param[in] period The timer period (beware the used clock).
+ * @return Void.
+ */
+void start_t1_a3_c0_it(unsigned int period);
+
 /**
  * @brief Stops Timer A3 CCR0 and sets the output pin to low logical level.
  * @return Void.
  */
 void stop_t1_a3_c0(void);
 
+/** Timer0_A3 overflows counted by #clock_ISR, high word of #clock_cycles */
+extern volatile unsigned int clock_ovf;
+
+/**
+ * SMCLK cycles spent by the interruption handlers, each one adds its own time
+ * measured with TA0R. Those which run while the CPU sleeps are busy time for
+ * #cpu_load.
+ */
+extern volatile unsigned long isr_cycles;
+
+/** SMCLK cycles since a TA0R value, at most 65535 (int may be wider) */
+#define CLOCK_SINCE(t) ((TA0R - (t)) & 0xFFFF)
+
+/**
+ * @brief Starts Timer0_A3 from SMCLK in continuous mode as the system clock,
+ * with its overflow interruption (#clock_ISR). Also starts the CPU load
+ * window (#cpu_load).
+ * @return Void.
+ */
+void start_t0_a3_clock(void);
+
+/**
+ * @brief Time given by Timer0_A3 and its overflows.
+ * @return SMCLK cycles since #start_t0_a3_clock, wraps after 536 s.
+ */
+unsigned long clock_cycles(void);
+
+/**
+ * @brief Enables the Timer0 A3 CCR0 interruption (#report_ISR), which is
+ * triggered one period from now and reschedules itself.
+ * @param[in] period The timer period (beware the used clock).
+ * @return Void.
+ */
+void start_t0_a3_c0_it(unsigned int period);
+
+/**
+ * @brief Disables the Timer0 A3 CCR0 interruption, the clock keeps running.
+ * @return Void.
+ */
+void stop_t0_a3_c0(void);
+
+/**
+ * @brief Sleeps in #IDLE_LPM_BITS until an interruption handler wakes the CPU
+ * up, counting the time slept for #cpu_load. Must be called with the
+ * interruptions disabled, to be sure the condition to sleep still holds; they
+ * are enabled while sleeping and disabled again on return.
+ * @return Void.
+ */
+void cpu_sleep(void);
+
+/**
+ * @brief Gets the CPU load since the last call and starts a new window.
+ * Windows longer than 268 s are scaled down, keeping the ratio.
+ * @param[out] busy: SMCLK cycles with the CPU awake.
+ * @param[out] total: SMCLK cycles of the window.
+ * @return Void.
+ */
+void cpu_load(unsigned long *busy, unsigned long *total);
+
 #endif
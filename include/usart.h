@@ -9,9 +9,80 @@
 #ifndef USART_H
 #define USART_H
 
+#include "sys_config.h"
+
+/* Binary protocol */
+/**
+ * @brief Start of binary frame. Frames are:
+ * SOF, command, sequence number, payload length, payload, CRC (LSB first).
+ * The CRC-16/CCITT (#crc16) is computed from the command to the end of the
+ * payload. Multi-byte numbers are little-endian.
+ */
+#define BIN_SOF (0xA5)
+/** Bytes from SOF to the payload length */
+#define BIN_HEADER_SIZE (4)
+/** Bytes of the CRC */
+#define BIN_CRC_SIZE (2)
+/**
+ * Move (G0/G1): axes mask (bit 0 X, 1 Y, 2 Z, 3 C, 4 E) and one int32 in
+ * steps for each axis in the mask, in this order. E in the mask selects the
+ * solder routine.
+ */
+#define BIN_MOVE (0x01)
+/** #BIN_MOVE and #BIN_SET_POS axes mask bits */
+#define BIN_AXIS_X (BIT0)
+#define BIN_AXIS_Y (BIT1)
+#define BIN_AXIS_Z (BIT2)
+#define BIN_AXIS_C (BIT3)
+#define BIN_AXIS_E (BIT4)
+/** Auto calibration (G33), no payload */
+#define BIN_CALIBRATE (0x02)
+/** Set position (G92), same payload as #BIN_MOVE */
+#define BIN_SET_POS (0x03)
+/** Vacuum (M10/M11), one byte: 1 on, 0 off */
+#define BIN_VACUUM (0x04)
+/** Status (M114), no payload */
+#define BIN_STATUS (0x05)
+/** Reply: the command was accepted (command | #BIN_ACK, same sequence) */
+#define BIN_ACK (0x80)
+/** Reply: CRC error or unknown command (same sequence) */
+#define BIN_NAK (0xFF)
+
+/* Software flow control */
+/** Resume transmission */
+#define XON (0x11)
+/** Pause transmission */
+#define XOFF (0x13)
+
+/** Line (or binary frame) being evaluated, filled by #read_line */
+extern char rx_data_raw[RX_STR_SIZE];
+/** Receiver ring buffer, filled by #received_data_ISR */
+extern char rx_ring[RX_RING_SIZE];
+/** Index of the next byte to be written in #rx_ring (ISR only) */
+extern volatile unsigned char rx_head;
+/** Index of the next byte to be read from #rx_ring (#read_line only) */
+extern volatile unsigned char rx_tail;
+/** Transmitter ring buffer, emptied by #transmit_data_ISR */
+extern char tx_ring[TX_RING_SIZE];
+/** Index of the next byte to be sent from #tx_ring */
+extern volatile unsigned char tx_tail;
+/** Bytes waiting in #tx_ring */
+extern volatile unsigned char tx_count;
+/** Echo received characters when one (M12), do not echo when zero (M13) */
+extern volatile char uart_echo;
+/** One if #rx_data_raw holds a binary frame instead of an ASCII line */
+extern char rx_binary;
+/** Send XON/XOFF to the host when one (M575 S1) */
+extern volatile char uart_xonxoff;
+/** One after XOFF was sent, until XON is sent by #read_line */
+extern volatile char rx_xoff;
+/** XON or XOFF to be sent before the data in #tx_ring, zero if none */
+extern volatile char tx_flow;
+
 /**
- * @brief Configures USCIAB0 in UART mode with 9600 bps, 8 bits, 1 stop bit and
- * with the RX interruption.
+ * @brief Configures USCIAB0 in UART mode with 9600 bps (#UART_DEFAULT_BAUD),
+ * 8 bits, 1 stop bit and with the RX interruption. The ring buffers are
+ * emptied.
  * System clock is supposed to be 8 MHz, according to the configurations made in
  * #initial_setup.
  * @return Void.
@@ -19,7 +90,33 @@
 void config_uart_usart0(void);
 
 /**
- * @brief Sends one byte through USCIAB0 using UART.
+ * @brief Checks if a baud rate is in the table of supported rates (9600,
+ * 19200, 38400, 57600 and 115200 bps).
+ * @param[in] baud: baud rate in bps.
+ * @return 1 if supported, 0 otherwise.
+ */
+char baud_supported(unsigned long baud);
+
+/**
+ * @brief Switches the UART to a new baud rate (M575).
+ *
+ * Waits until all queued data is sent at the current rate, switches and waits
+ * up to #BAUD_CONFIRM_MS for the host to send a G/M-code line which parses
+ * cleanly (#parse_line) or a binary frame with a valid CRC at the new rate;
+ * other lines are discarded. If none arrives the previous rate is restored and
+ * the received bytes are discarded. Unsupported rates are ignored.
+ * @param[in] baud: baud rate in bps.
+ * @return Void.
+ */
+void change_baud_rate(unsigned long baud);
+
+/**
+ * @brief Queues one byte in #tx_ring to be sent through USCIAB0 by
+ * #transmit_data_ISR.
+ *
+ * Only waits if the ring is full: with the interruptions enabled until
+ * #transmit_data_ISR makes room, otherwise (from an ISR) the oldest bytes are
+ * written directly to the USCI.
  * @param[in] c: character to be sent.
  * @return Void.
  */
@@ -33,6 +130,48 @@ void send_char(char c);
  */
 void send_string(char *str);
 
+/**
+ * @brief Moves the received bytes from #rx_ring to #rx_data_raw.
+ *
+ * When a terminator (`\0`, `;`, `*` or `(`) is read or #rx_data_raw is full,
+ * the line is null terminated and #execute_routine is set, what follows is
+ * the next line. After `(` the comment is discarded up to `)` and a `\0` or
+ * `\n` right after it, or up to the first `\0` or `\n`. ASCII characters
+ * are echoed if #uart_echo is set.
+ * A #BIN_SOF byte starts a binary frame, which is stored as received and sets
+ * #rx_binary and #execute_routine when complete. A frame longer than
+ * #rx_data_raw is answered with #BIN_NAK and the bytes are discarded up to the
+ * next #BIN_SOF.
+ * Nothing is read while #execute_routine is set, the bytes wait in #rx_ring.
+ * XON is sent if XOFF was sent and the ring has #RX_XON_LEVEL bytes or less.
+ * @return Void.
+ */
+void read_line(void);
+
+/**
+ * @brief Computes the CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF)
+ * used by the binary frames.
+ * @param[in] data: bytes to be checked.
+ * @param[in] len: number of bytes.
+ * @return The CRC.
+ */
+unsigned int crc16(const char *data, int len);
+
+/**
+ * @brief Checks the CRC of the binary frame in #rx_data_raw.
+ * @return 1 if the CRC matches, 0 otherwise.
+ */
+char frame_valid(void);
+
+/**
+ * @brief Sends a binary frame without payload, used for the replies
+ * (#BIN_ACK and #BIN_NAK).
+ * @param[in] cmd: command byte.
+ * @param[in] seq: sequence number.
+ * @return Void.
+ */
+void send_frame(unsigned char cmd, unsigned char seq);
+
 /**
  * @brief Validates the buffer #rx_data_raw.
  *
@@ -43,19 +182,97 @@ void send_string(char *str);
  */
 void validate_str(void);
 
+/** Words of the G/M-codes kept by #parse_line */
+enum word_id {
+	WORD_G,
+	WORD_M,
+	WORD_X,
+	WORD_Y,
+	WORD_Z,
+	WORD_C,
+	WORD_E,
+	WORD_F,
+	WORD_S,
+	WORD_B,
+	/** Arc center and radius (G2/G3) */
+	WORD_I,
+	WORD_J,
+	WORD_R,
+	WORDS
+};
+
+/**
+ * @brief Words of one G/M-code line, filled by #parse_line. Only where each
+ * number starts is kept, #get_word converts it again when asked: a table of
+ * longs would take four times the stack.
+ */
+struct words {
+	/**
+	 * Index in #rx_data_raw of the number of each word, indexed by
+	 * #word_id, zero if the word is not in the line
+	 */
+	unsigned char at[WORDS];
+};
+
+/**
+ * @brief Splits the line in #rx_data_raw in words (a letter followed by a
+ * number) in a single left to right pass.
+ *
+ * The numbers are parsed with integer arithmetic only, as fixed-point numbers
+ * with the decimal places of their letter (see #get_word); extra decimal
+ * places are ignored. Lower case letters are accepted, spaces are skipped
+ * and ';', '*' or '(' end the line.
+ * Letters which are not in #word_id are parsed and discarded. If a word
+ * appears twice the last one is kept.
+ * @param[out] w: words found.
+ * @return 0 on success, -1 if a letter is not followed by a valid number, if
+ * a number would overflow #PARAM_MAX or if there is anything else in the
+ * line.
+ */
+signed char parse_line(struct words *w);
+
 /**
- * @brief Parses numbers after a character in #rx_data_raw. Useful for parsing
- * parameters to G or M codes.
+ * @brief Gets a word of a line parsed by #parse_line, while the line is still
+ * in #rx_data_raw.
  *
- * The function searches for one character in #rx_data_raw and if it is found,
- * searches for a valid float number right after it. If the desired character is
- * not found, if the number found would overflow or underflow a float or if no
- * valid number is found after the character, return #dft_ret as an error.
- * @param[in] c: character to be found in #rx_data_raw.
- * @param[in] dft_ret: code to return on error.
- * @return the number right after #c or #dft_ret if an error occurs.
+ * The axes (X, Y, Z, C and E), I, J, R and S are fixed-point numbers times
+ * #FIXED_ONE,
+ * F is in mm/min times #FEED_ONE, G, M and B are integers.
+ * @param[in] w: words of the line.
+ * @param[in] c: letter of the word.
+ * @param[in] dft_ret: returned if the word is not in the line.
+ * @return The value of the word or #dft_ret.
+ */
+long get_word(const struct words *w, char c, long dft_ret);
+
+/**
+ * @brief Sends a fixed-point number straight to #send_char, rounded to a
+ * number of decimal places, without trailing zeros (nor the point if no
+ * decimal place is left).
+ *
+ * The digits are found from the most significant one by subtracting powers
+ * of ten, so there is no division (a libgcc call on the MSP430) and no
+ * intermediate string.
+ * @param[in] v: number times 10^digits.
+ * @param[in] digits: decimal places of #v, 9 at most.
+ * @param[in] prec: decimal places to be sent at most, #digits at most.
+ * @return Void.
+ */
+void print_decimal(long v, unsigned char digits, unsigned char prec);
+
+/**
+ * @brief Sends a fixed-point number (see #get_word) with up to
+ * #REPORT_DIGITS decimal places through #print_decimal.
+ * @param[in] v: number times #FIXED_ONE.
+ * @return Void.
+ */
+void print_fixed(long v);
+
+/**
+ * @brief Sends an integer through #print_decimal.
+ * @param[in] v: number.
+ * @return Void.
  */
-float parse_param(char c, float dft_ret);
+void print_int(long v);
 
-void print_float(float f);
 #endif
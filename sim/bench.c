@@ -0,0 +1,504 @@
+/**
+ * @file
+ * @brief Benchmarks the firmware hot paths on the simulator (see sim.h): the
+ * step interruption over a set of move geometries and an arc, the G-code
+ * parser over a corpus of lines, the cruise periods of a few feed moves and
+ * the status report.
+ *
+ * The cycles come from the simulator cycle model and the firmware output is
+ * discarded, only the bytes are counted. The run fails if the step
+ * interruption costs more than #BENCH_STEP_CYCLES_MAX per step or the parser
+ * more than #BENCH_LINE_CYCLES_MAX per line on average, or if a ramp step
+ * does not fit its period (#bench_ramp), so a change which makes them slower
+ * is caught. It also fails if the lines with comments or a frame too long are
+ * not read as expected (#check_comments, #check_long_frame). The budgets must only be raised deliberately.
+ * @author Davi Antônio da Silva Santos
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "msp430.h"
+#include "sys_config.h"
+#include "usart.h"
+#include "sys_control.h"
+#include "stepper.h"
+#include "planner.h"
+#include "sim.h"
+
+/**
+ * Largest mean cycles per step accepted for any geometry. Arming the Timer1_A3
+ * outputs (#STEP_TIMER_OUTPUTS) costs a few cycles more than toggling the
+ * pins, in exchange the X, Y and Z edges no longer depend on the latency. The
+ * straight moves also pay the test for arcs (#stepper_arc_next) and the ramp
+ * steps their division (#ramp_next), which is firmware code and so charged. The
+ * moves shorter than #BENCH_STEP_MIN_STEPS are only ramps, they are checked by
+ * #bench_ramp instead.
+ */
+#define BENCH_STEP_CYCLES_MAX (205)
+/** Moves with fewer steps are left out of the step interruption budget */
+#define BENCH_STEP_MIN_STEPS (100)
+/**
+ * Largest mean cycles per iteration of an arc (G2/G3) accepted in the step
+ * interruption. The arcs run at the Y axis rate at most (1887 cycles), the
+ * sqrt(2) grid steps iterations pay the stretch of their period
+ * (#ARC_DIAG_PERIOD).
+ */
+#define BENCH_ARC_CYCLES_MAX (420)
+/**
+ * Largest cycles accepted for #arc_plan, which runs in the main loop while the
+ * previous block is moving (1 ms)
+ */
+#define BENCH_ARC_PLAN_CYCLES_MAX (8000)
+/** Largest mean cycles per parsed line accepted */
+#define BENCH_LINE_CYCLES_MAX (1400)
+
+/**
+ * @brief One move of the geometries corpus.
+ */
+struct bench_move {
+	const char *name;
+	/** Relative move in steps, indexed by #axis_id */
+	long delta[DDA_AXES];
+};
+
+/** Dominant X, Y and Z, long, short, negative and five axes moves */
+static const struct bench_move moves[] = {
+	{"X dominant", {32400, 6340, 1039, 0, 0}},
+	{"Y dominant", {6480, 31700, 2078, 0, 0}},
+	{"Z dominant", {324, 317, 20780, 0, 0}},
+	{"X only", {16200, 0, 0, 0, 0}},
+	{"short", {5, -3, 2, 0, 0}},
+	{"negative", {-16200, -15850, -5195, 0, 0}},
+	{"five axes", {9720, 3170, 2078, 3240, 4267}}
+};
+
+/** G/M-code lines corpus, negative and long numbers included */
+static const char *lines[] = {
+	"G1 X10.5 Y-3.25 Z1 F1200",
+	"G0 X298.123456 Y369.999999 Z64.41",
+	"G1 X-0.000001 Y-12 C-90 E0.5",
+	"G92 X0 Y0 Z0 C0 E0",
+	"G1 E-1.25 F60",
+	"M114",
+	"G0 Z5"
+};
+
+/**
+ * Bytes received with comments between parentheses (#read_line) and the lines
+ * they must give, one per host line
+ */
+static const char comment_rx[] = "G1 X10 (comment here)\0G1 X2 (a)G1 X3\0"
+	"G1 (no end\0G1 X4 (b)\r\nG1 X5;";
+static const char *comment_lines[] = {
+	"G1 X10 (", "G1 X2 (", "G1 X3", "G1 (", "G1 X4 (", "G1 X5;"
+};
+
+
+/**
+ * Moves given to #feed_period at the default feedrate, in steps: a short X path
+ * with a long E move (G1 X0.0124 E23.5) scales the path length down to zero
+ */
+static const struct bench_move feeds[] = {
+	{"X dominant", {32400, 6340, 1039, 0, 0}},
+	{"C only", {0, 0, 0, 3240, 0}},
+	{"tiny X, E", {4, 0, 0, 0, 100274}},
+	{"one step", {1, 0, 0, 0, 0}}
+};
+
+/**
+ * @brief Runs the simulation until the UART has sent everything.
+ * @return Void.
+ */
+static void wait_tx(void)
+{
+	while (!sim_tx_idle())
+		sim_advance(100);
+}
+
+/**
+ * @brief Benchmarks the step interruption.
+ * @return Worst mean cycles per step.
+ */
+static unsigned long bench_steps(void)
+{
+	const struct bench_move *m;
+	struct sim_irq_stats before;
+	struct sim_irq_stats after;
+	unsigned long steps;
+	unsigned long cycles;
+	unsigned long worst = 0;
+	unsigned int i;
+
+	printf("%-12s %8s %12s\n", "geometry", "steps", "cycles/step");
+
+	for (i = 0; i < sizeof(moves) / sizeof(moves[0]); i++) {
+		m = &moves[i];
+		before = sim_irq_stats(SIM_IRQ_TIMER1_A0);
+		stepper_move(m->delta, 0);
+		while (stepper_busy());
+		after = sim_irq_stats(SIM_IRQ_TIMER1_A0);
+
+		steps = after.calls - before.calls;
+		cycles = (after.cycles - before.cycles) * 10 / steps;
+		printf("%-12s %8lu %10lu.%lu\n", m->name, steps, cycles / 10,
+		       cycles % 10);
+
+		if ((steps >= BENCH_STEP_MIN_STEPS) && (cycles > worst))
+			worst = cycles;
+	}
+
+	return worst / 10;
+}
+
+/**
+ * @brief Benchmarks the velocity profile alone over the ramps of a Z move, the
+ * fastest axis. The divisions of the first steps are the longest, while the
+ * periods are long too: each step must leave the rest of the interruption
+ * (#BENCH_STEP_CYCLES_MAX) within the period it computes.
+ * @return Smallest slack in cycles, negative if a step is too long.
+ */
+static long bench_ramp(void)
+{
+	struct ramp r;
+	unsigned long long start;
+	unsigned long long total = 0;
+	unsigned long cycles;
+	unsigned long longest = 0;
+	unsigned int period;
+	long slack;
+	long worst = 0xFFFF;
+	unsigned long i;
+	const unsigned long steps = 20780;
+
+	__disable_interrupt();
+	ramp_init(&r, steps, MIN_PULSE_PERIOD_ZDIR, ACCEL_Z);
+	for (i = 1; i < steps; i++) {
+		start = sim_cycles();
+		period = ramp_next(&r);
+		cycles = sim_cycles() - start;
+		total += cycles;
+		if (cycles > longest)
+			longest = cycles;
+		slack = (long)period + 1 - (long)cycles - BENCH_STEP_CYCLES_MAX;
+		if (slack < worst)
+			worst = slack;
+	}
+	__enable_interrupt();
+
+	printf("\n%-12s %8s %12s %12s %12s\n", "ramp", "steps", "cycles/step",
+	       "longest", "min slack");
+	printf("%-12s %8lu %12llu %12lu %12ld\n", "Z", steps,
+	       total / (steps - 1), longest, worst);
+
+	return worst;
+}
+
+/**
+ * @brief Benchmarks a whole circle of 10 mm of radius: its planning and its
+ * step interruptions.
+ * @param[out] plan_cycles: cycles of #arc_plan.
+ * @return Mean cycles of the step interruption per iteration.
+ */
+static unsigned long bench_arc(unsigned long *plan_cycles)
+{
+	/** Circle around the center 10 mm to the right */
+	struct block_arc arc;
+	/** Start and end of the circle */
+	const struct steps_pos origin = {0, 0, 0, 0};
+	/** Steps of each axis, X and Y are the distance from the start */
+	long steps[DDA_AXES];
+	/** No other axis moves */
+	long delta[DDA_AXES] = {0};
+	struct sim_irq_stats before;
+	struct sim_irq_stats after;
+	unsigned long long start;
+	unsigned long plan;
+	unsigned long step;
+
+	arc.dir = -1;
+	arc_center(&arc, &origin, &origin, 10 * FIXED_ONE, 0, PARAM_NONE);
+
+	__disable_interrupt();
+	start = sim_cycles();
+	arc_plan(&arc);
+	plan = sim_cycles() - start;
+	__enable_interrupt();
+
+	before = sim_irq_stats(SIM_IRQ_TIMER1_A0);
+	stepper_arc(&arc, delta, 0);
+	while (stepper_busy());
+	after = sim_irq_stats(SIM_IRQ_TIMER1_A0);
+	step = (after.cycles - before.cycles) * 10 / arc.n;
+	stepper_steps(steps);
+
+	printf("\n%-12s %8s %12s %12s %12s\n", "arc", "iters", "plan",
+	       "step/iter", "end X, Y");
+	printf("%-12s %8lu %12lu %10lu.%lu %7ld, %ld\n", "circle", arc.n, plan,
+	       step / 10, step % 10, steps[AXIS_X], steps[AXIS_Y]);
+
+	*plan_cycles = plan;
+	return step / 10;
+}
+
+/**
+ * @brief Computes the cruise period of the feeds corpus, which must not fault.
+ * @return Void.
+ */
+static void bench_feed(void)
+{
+	unsigned long long start;
+	unsigned long cycles;
+	unsigned int period;
+	unsigned int i;
+	long delta[DDA_AXES];
+
+	printf("\n%-12s %8s %12s\n", "feed", "period", "cycles");
+
+	for (i = 0; i < sizeof(feeds) / sizeof(feeds[0]); i++) {
+		memcpy(delta, feeds[i].delta, sizeof(delta));
+		start = sim_cycles();
+		period = feed_period(NULL, delta, DEFAULT_FEEDRATE);
+		cycles = sim_cycles() - start;
+		printf("%-12s %8u %12lu\n", feeds[i].name, period, cycles);
+	}
+}
+
+/**
+ * @brief Benchmarks the G/M-code parser.
+ * @return Mean cycles per line.
+ */
+static unsigned long bench_parse(void)
+{
+	unsigned long long start;
+	unsigned long long total = 0;
+	unsigned long cycles;
+	unsigned int i;
+	struct words w;
+
+	printf("\n%-36s %8s\n", "line", "cycles");
+
+	/* Nothing else runs meanwhile */
+	__disable_interrupt();
+	for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+		strcpy(rx_data_raw, lines[i]);
+		start = sim_cycles();
+		parse_line(&w);
+		cycles = sim_cycles() - start;
+		total += cycles;
+		printf("%-36s %8lu\n", lines[i], cycles);
+	}
+	__enable_interrupt();
+
+	return total / i;
+}
+
+/**
+ * @brief Receives one byte through #rx_ring and reads it with #read_line.
+ * @param[in] c: byte received.
+ * @return Void.
+ */
+static void bench_rx(char c)
+{
+	__disable_interrupt();
+	rx_ring[rx_head] = c;
+	rx_head = (rx_head + 1) & (RX_RING_SIZE - 1);
+	__enable_interrupt();
+
+	read_line();
+}
+
+/**
+ * @brief Checks that the comments are discarded by #read_line and
+ * #parse_line without taking the next line with them.
+ * @return Number of lines which differ from #comment_lines.
+ */
+static unsigned int check_comments(void)
+{
+	unsigned int i;
+	unsigned int n = 0;
+	unsigned int errors = 0;
+	struct words w;
+
+	for (i = 0; i < sizeof(comment_rx) - 1; i++) {
+		bench_rx(comment_rx[i]);
+		if (!execute_routine)
+			continue;
+
+		if ((n >= sizeof(comment_lines) / sizeof(comment_lines[0]))
+		    || strcmp(rx_data_raw, comment_lines[n])
+		    || parse_line(&w)) {
+			printf("FAIL: comment line %u read as \"%s\"\n", n,
+			       rx_data_raw);
+			errors++;
+		}
+		n++;
+		execute_routine = 0;
+	}
+	if (n != sizeof(comment_lines) / sizeof(comment_lines[0])) {
+		printf("FAIL: %u lines read with comments, %u expected\n", n,
+		       (unsigned int)(sizeof(comment_lines)
+				      / sizeof(comment_lines[0])));
+		errors++;
+	}
+
+	return errors;
+}
+
+/**
+ * @brief Checks that a binary frame too long for #rx_data_raw is answered
+ * with #BIN_NAK and that its payload is discarded up to the next frame.
+ * @return Number of failed checks.
+ */
+static unsigned int check_long_frame(void)
+{
+	/** Header of a frame with 255 bytes of payload */
+	static const char header[] = {(char)BIN_SOF, BIN_STATUS, 7, (char)255};
+	/** Status frame received after the payload */
+	char frame[BIN_HEADER_SIZE + BIN_CRC_SIZE] = {
+		(char)BIN_SOF, BIN_STATUS, 8, 0
+	};
+	unsigned int crc = crc16(&frame[1], BIN_HEADER_SIZE - 1);
+	unsigned long bytes;
+	unsigned int errors = 0;
+	unsigned int i;
+
+	frame[BIN_HEADER_SIZE] = crc & 0xFF;
+	frame[BIN_HEADER_SIZE + 1] = crc >> 8;
+
+	wait_tx();
+	bytes = sim_tx_bytes();
+	for (i = 0; i < sizeof(header); i++)
+		bench_rx(header[i]);
+	wait_tx();
+	if (sim_tx_bytes() - bytes != BIN_HEADER_SIZE + BIN_CRC_SIZE) {
+		printf("FAIL: no NAK for a frame too long\n");
+		errors++;
+	}
+
+	/* Payload bytes, NULs end ASCII lines */
+	for (i = 0; i < 10; i++) {
+		bench_rx('\0');
+		if (execute_routine) {
+			printf("FAIL: payload of a frame too long read\n");
+			execute_routine = 0;
+			errors++;
+		}
+	}
+
+	for (i = 0; i < sizeof(frame); i++)
+		bench_rx(frame[i]);
+	if (!execute_routine || !rx_binary || (rx_data_raw[2] != 8)) {
+		printf("FAIL: frame after a frame too long not read\n");
+		errors++;
+	}
+	execute_routine = 0;
+
+	return errors;
+}
+
+/**
+ * @brief Benchmarks the status reports and one number formatting.
+ * @return Void.
+ */
+static void bench_report(void)
+{
+	unsigned long long start;
+	unsigned long long end;
+	unsigned long bytes;
+
+	printf("\n%-12s %8s %12s %12s\n", "report", "bytes", "cycles",
+	       "ms at 9600");
+
+	wait_tx();
+	bytes = sim_tx_bytes();
+	start = sim_cycles();
+	print_fixed(-123456789L);
+	end = sim_cycles();
+	wait_tx();
+	bytes = sim_tx_bytes() - bytes;
+	printf("%-12s %8lu %12llu %12lu\n", "print_fixed", bytes, end - start,
+	       bytes * 10 * 1000 / 9600);
+
+	bytes = sim_tx_bytes();
+	start = sim_cycles();
+	status();
+	end = sim_cycles();
+	wait_tx();
+	bytes = sim_tx_bytes() - bytes;
+	printf("%-12s %8lu %12llu %12lu\n", "status", bytes, end - start,
+	       bytes * 10 * 1000 / 9600);
+
+	bytes = sim_tx_bytes();
+	start = sim_cycles();
+	status_compact();
+	end = sim_cycles();
+	wait_tx();
+	bytes = sim_tx_bytes() - bytes;
+	printf("%-12s %8lu %12llu %12lu\n", "compact", bytes, end - start,
+	       bytes * 10 * 1000 / 9600);
+}
+
+int main(void)
+{
+	unsigned long step_cycles;
+	unsigned long arc_cycles;
+	unsigned long plan_cycles;
+	unsigned long line_cycles;
+	unsigned long longest;
+	long ramp_slack;
+	int ret = EXIT_SUCCESS;
+
+	sim_reset();
+	initial_setup();
+	config_uart_usart0();
+
+	/* The corpus moves past the endstops */
+	P1IE = 0;
+	P2IE = 0;
+	uart_echo = 0;
+	__enable_interrupt();
+
+	step_cycles = bench_steps();
+	arc_cycles = bench_arc(&plan_cycles);
+	longest = sim_irq_stats(SIM_IRQ_TIMER1_A0).max;
+	ramp_slack = bench_ramp();
+	bench_feed();
+	line_cycles = bench_parse();
+	if (check_comments())
+		ret = EXIT_FAILURE;
+	if (check_long_frame())
+		ret = EXIT_FAILURE;
+	bench_report();
+
+	printf("\nstep interruption: %lu cycles at most, %lu cycles for the "
+	       "longest step, %u cycles at the fastest axis rate (Z)\n",
+	       step_cycles, longest, MIN_PULSE_PERIOD_ZDIR + 1);
+
+	if (step_cycles > BENCH_STEP_CYCLES_MAX) {
+		printf("FAIL: step interruption over %u cycles\n",
+		       BENCH_STEP_CYCLES_MAX);
+		ret = EXIT_FAILURE;
+	}
+	if (ramp_slack < 0) {
+		printf("FAIL: a ramp step does not fit its period\n");
+		ret = EXIT_FAILURE;
+	}
+	if (arc_cycles > BENCH_ARC_CYCLES_MAX) {
+		printf("FAIL: arc over %u cycles per iteration\n",
+		       BENCH_ARC_CYCLES_MAX);
+		ret = EXIT_FAILURE;
+	}
+	if (plan_cycles > BENCH_ARC_PLAN_CYCLES_MAX) {
+		printf("FAIL: arc planned in over %u cycles\n",
+		       BENCH_ARC_PLAN_CYCLES_MAX);
+		ret = EXIT_FAILURE;
+	}
+	if (line_cycles > BENCH_LINE_CYCLES_MAX) {
+		printf("FAIL: parser over %u cycles per line\n",
+		       BENCH_LINE_CYCLES_MAX);
+		ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
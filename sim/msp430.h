@@ -0,0 +1,124 @@
+/**
+ * @file
+ * @brief Replaces the MSP430G2553 device header in the host build (see
+ * sim.c). Only the registers, bits and intrinsics used by the firmware are
+ * defined, with the same values as the device header.
+ *
+ * Most registers are plain variables, so their addresses are constants just
+ * like on the device (see #axes). The registers which are polled by the
+ * firmware or have side effects on access go through the simulator, which
+ * advances the virtual time on every access.
+ * @author Davi Antônio da Silva Santos
+ */
+
+#ifndef SIM_MSP430_H
+#define SIM_MSP430_H
+
+/* The vectors are handled by the simulator, not by the compiler */
+#define interrupt(vector) unused
+
+/* Bits */
+#define BIT0 (0x0001)
+#define BIT1 (0x0002)
+#define BIT2 (0x0004)
+#define BIT3 (0x0008)
+#define BIT4 (0x0010)
+#define BIT5 (0x0020)
+#define BIT6 (0x0040)
+#define BIT7 (0x0080)
+
+/* Status register */
+#define GIE (0x0008)
+#define CPUOFF (0x0010)
+#define OSCOFF (0x0020)
+#define SCG0 (0x0040)
+#define SCG1 (0x0080)
+#define LPM0_bits (CPUOFF)
+#define LPM1_bits (SCG0 | CPUOFF)
+#define LPM3_bits (SCG1 | SCG0 | CPUOFF)
+#define LPM4_bits (SCG1 | SCG0 | OSCOFF | CPUOFF)
+
+/* Interruption vectors */
+#define PORT1_VECTOR (3)
+#define PORT2_VECTOR (4)
+#define USCIAB0TX_VECTOR (7)
+#define USCIAB0RX_VECTOR (8)
+#define TIMER0_A1_VECTOR (9)
+#define TIMER0_A0_VECTOR (10)
+#define TIMER1_A1_VECTOR (13)
+#define TIMER1_A0_VECTOR (14)
+
+/* Watchdog */
+#define WDTPW (0x5A00)
+#define WDTHOLD (0x0080)
+
+/* USCI_A0 */
+#define UCA0RXIE (0x01)
+#define UCA0TXIE (0x02)
+#define UCA0RXIFG (0x01)
+#define UCA0TXIFG (0x02)
+#define UCSWRST (0x01)
+#define UCSSEL_2 (0x80)
+#define UCOS16 (0x01)
+#define UCBRS_0 (0x00)
+#define UCBUSY (0x01)
+#define UCOE (0x20)
+
+/* Timer_A */
+#define TASSEL_2 (0x0200)
+#define MC_0 (0x0000)
+#define MC_1 (0x0010)
+#define MC_2 (0x0020)
+#define MC_3 (0x0030)
+#define TACLR (0x0004)
+#define TAIE (0x0002)
+#define TAIFG (0x0001)
+#define CCIE (0x0010)
+#define CCIFG (0x0001)
+#define OUT (0x0004)
+#define OUTMOD_0 (0x0000)
+#define OUTMOD_4 (0x0080)
+#define OUTMOD_7 (0x00E0)
+#define TA0IV_TAIFG (0x000A)
+#define TA1IV_TAIFG (0x000A)
+
+/* Registers without side effects */
+extern volatile unsigned char P1IN, P1OUT, P1DIR, P1IFG, P1IES, P1IE, P1SEL,
+	P1SEL2, P1REN;
+extern volatile unsigned char P2IN, P2OUT, P2DIR, P2IFG, P2IES, P2IE, P2SEL,
+	P2SEL2, P2REN;
+extern volatile unsigned char IE2, UCA0CTL0, UCA0CTL1, UCA0BR0, UCA0BR1,
+	UCA0MCTL;
+extern volatile unsigned char DCOCTL, BCSCTL1, CALBC1_8MHZ, CALDCO_8MHZ;
+extern volatile unsigned int WDTCTL, TA0CTL, TA0R, TA0CCTL0, TA0CCTL1,
+	TA0CCTL2, TA0CCR0, TA0CCR1, TA0CCR2;
+extern volatile unsigned int TA1CTL, TA1R, TA1CCTL0, TA1CCTL1, TA1CCTL2,
+	TA1CCR0, TA1CCR1, TA1CCR2;
+
+/* Registers accessed through the simulator */
+volatile unsigned char *sim_ifg2(void);
+volatile unsigned char *sim_uca0stat(void);
+volatile unsigned char *sim_uca0rxbuf(void);
+volatile unsigned char *sim_uca0txbuf(void);
+volatile unsigned int *sim_ta0iv(void);
+volatile unsigned int *sim_ta1iv(void);
+
+#define IFG2 (*sim_ifg2())
+#define UCA0STAT (*sim_uca0stat())
+#define UCA0RXBUF (*sim_uca0rxbuf())
+#define UCA0TXBUF (*sim_uca0txbuf())
+#define TA0IV (*sim_ta0iv())
+#define TA1IV (*sim_ta1iv())
+
+/* Intrinsics */
+void __delay_cycles(unsigned long cycles);
+unsigned int __get_SR_register(void);
+void __bis_SR_register(unsigned int bits);
+void __bic_SR_register(unsigned int bits);
+void __bis_SR_register_on_exit(unsigned int bits);
+void __bic_SR_register_on_exit(unsigned int bits);
+void __enable_interrupt(void);
+void __disable_interrupt(void);
+void __no_operation(void);
+
+#endif
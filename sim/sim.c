@@ -0,0 +1,1122 @@
+/**
+ * @file
+ * @brief Implements the MSP430G2553 simulator used by the host build: the
+ * registers of msp430.h, the intrinsics, the peripherals, the simulated host
+ * and the machine axes.
+ * @author Davi Antônio da Silva Santos
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "msp430.h"
+#include "sys_config.h"
+#include "interrupts.h"
+#include "usart.h"
+#include "stepper.h"
+#include "sim.h"
+
+/* Registers without side effects */
+volatile unsigned char P1IN, P1OUT, P1DIR, P1IFG, P1IES, P1IE, P1SEL, P1SEL2,
+	P1REN;
+volatile unsigned char P2IN, P2OUT, P2DIR, P2IFG, P2IES, P2IE, P2SEL, P2SEL2,
+	P2REN;
+volatile unsigned char IE2, UCA0CTL0, UCA0CTL1 = UCSWRST, UCA0BR0, UCA0BR1,
+	UCA0MCTL;
+volatile unsigned char DCOCTL, BCSCTL1, CALBC1_8MHZ = 0x8D, CALDCO_8MHZ = 0x92;
+volatile unsigned int WDTCTL, TA0CTL, TA0R, TA0CCTL0, TA0CCTL1, TA0CCTL2,
+	TA0CCR0, TA0CCR1, TA0CCR2;
+volatile unsigned int TA1CTL, TA1R, TA1CCTL0, TA1CCTL1, TA1CCTL2, TA1CCR0,
+	TA1CCR1, TA1CCR2;
+
+/*
+ * Linker script symbols of the device, see #stack_paint: the RAM between the
+ * variables and the top of the RAM, never reached here
+ */
+char end[SIM_STACK_BYTES];
+__asm__(".globl __stack\n\t.set __stack, end + " SIM_STR(SIM_STACK_BYTES));
+
+/** Registers accessed through the simulator */
+static volatile unsigned char ifg2 = UCA0TXIFG;
+static volatile unsigned char uca0stat;
+static volatile unsigned char uca0rxbuf;
+static volatile unsigned char uca0txbuf;
+
+/** Virtual time in cycles */
+static unsigned long long now;
+/** Status register */
+static unsigned int sr;
+/** Status register saved when the running handler was called, if any */
+static unsigned int *isr_sr;
+
+/**
+ * @brief One Timer_A3 clocked by SMCLK: its registers and its counter, which
+ * is copied to TAxR as the time advances.
+ */
+struct sim_timer {
+	volatile unsigned int *ctl;
+	volatile unsigned int *r;
+	volatile unsigned int *cctl[3];
+	volatile unsigned int *ccr[3];
+	unsigned int count;
+	/** Last TAxIV value read */
+	unsigned int iv;
+	/** Output units levels, only OUTMOD_0 and OUTMOD_4 are simulated */
+	unsigned char out[3];
+};
+
+/** Timer0_A3 and Timer1_A3 */
+static struct sim_timer timers[] = {
+	{&TA0CTL, &TA0R, {&TA0CCTL0, &TA0CCTL1, &TA0CCTL2},
+	 {&TA0CCR0, &TA0CCR1, &TA0CCR2}, 0, 0, {0}},
+	{&TA1CTL, &TA1R, {&TA1CCTL0, &TA1CCTL1, &TA1CCTL2},
+	 {&TA1CCR0, &TA1CCR1, &TA1CCR2}, 0, 0, {0}}
+};
+/** Number of timers */
+#define SIM_TIMERS (sizeof(timers) / sizeof(timers[0]))
+
+/**
+ * @brief Port 2 pin which can be driven by a timer output unit (P2SEL set,
+ * P2SEL2 clear).
+ */
+struct sim_timer_pin {
+	unsigned char mask;
+	unsigned char timer;
+	unsigned char unit;
+};
+
+/** P2.0 is TA1.0, P2.1 is TA1.1 and P2.5 is TA1.2 */
+static const struct sim_timer_pin timer_pins[] = {
+	{BIT0, 1, 0},
+	{BIT1, 1, 1},
+	{BIT5, 1, 2}
+};
+
+/** UCA0TXBUF was written since the last update */
+static char tx_written;
+/** UCA0TXBUF holds a byte waiting for the shift register */
+static char txbuf_full;
+/** Byte being transmitted and the time it ends */
+static char tx_shifting;
+static unsigned char tx_shift;
+static unsigned long long tx_done_at;
+/** Byte being received and the time it ends */
+static char rx_shifting;
+static unsigned char rx_shift;
+static unsigned long long rx_done_at;
+/** Bytes lost because UCA0RXBUF was not read in time */
+static unsigned long overruns;
+/** Bytes dropped by the firmware because its RX ring was full */
+static unsigned long ring_drops;
+/** Bytes sent by the firmware */
+static unsigned long tx_bytes;
+
+/** Handlers statistics, indexed by #sim_irq */
+static struct sim_irq_stats irq_stats[SIM_IRQS];
+
+/** Simulated host */
+static FILE *input;
+static FILE *output;
+static char line[256];
+static size_t line_len;
+static size_t line_pos;
+static char input_eof;
+static enum sim_host host_mode;
+static char host_paused;
+/** #line holds a line which was not sent yet */
+static char line_ready;
+static unsigned long lines_sent;
+/** Last characters received, to find "done" and "ok" */
+static char tail[5];
+/**
+ * Lines acknowledged, by "ok" or "done": each line gets one of them, "ok"
+ * while M14 is in effect and "done" otherwise, the M14 and M15 lines included
+ */
+static unsigned long acks;
+/** Sizes of the lines not acknowledged yet, indexed by the line number */
+static unsigned char unacked[64];
+/** Bytes of the lines not acknowledged yet, the oldest one excluded */
+static unsigned int credit_used;
+/** The firmware line being received is an "ok" or a "done" */
+static char rx_ok;
+/** Pseudo-terminal master (#SIM_HOST_PTY), -1 if none */
+static int pty = -1;
+/** Wall clock when the pseudo-terminal was opened */
+static struct timespec pty_start;
+/** Virtual time of the next comparison with the wall clock */
+static unsigned long long pty_pace_at;
+/** Set by #sim_stop */
+static volatile sig_atomic_t stop;
+
+/**
+ * @brief Step statistics of one axis in the pins trace.
+ */
+struct sim_trace_axis {
+	unsigned long steps;
+	/** Time of the last step */
+	unsigned long long last;
+	/** Shortest time between two steps, ~0 if none */
+	unsigned long long min;
+	/** Steps and time between the steps closer than #SIM_TRACE_GAP_MS */
+	unsigned long moving_steps;
+	unsigned long long moving;
+	/** Time of the last direction change, #dir_pending until the next step */
+	unsigned long long dir_at;
+	char dir_pending;
+	/** Shortest time from a direction change to the next step, ~0 if none */
+	unsigned long long setup_min;
+};
+
+/** Pins trace (#sim_trace_open) */
+static FILE *trace;
+/** Traced levels: the step and direction pins of each axis, the vacuum */
+static unsigned char trace_last[SIM_TRACE_PINS];
+/** Time of the last change written */
+static unsigned long long trace_at;
+static struct sim_trace_axis trace_axes[DDA_AXES];
+
+/** Machine */
+static long pos[DDA_AXES];
+static unsigned char p1_last;
+static unsigned char p2_last;
+static unsigned long long last_activity;
+static unsigned long long time_limit = (unsigned long long)SIM_TIME_LIMIT_S
+	* SMCLK_HZ;
+
+/**
+ * @brief Time taken by one UART character (start, 8 data and stop bits).
+ * @return Cycles per character.
+ */
+static unsigned long char_cycles(void)
+{
+	/** Cycles per bit */
+	unsigned long bit = UCA0BR0 | ((unsigned int)UCA0BR1 << 8);
+
+	if (UCA0MCTL & UCOS16)
+		bit = 16*bit + ((UCA0MCTL >> 4) & 0x0F);
+
+	return bit ? 10*bit : 10;
+}
+
+/**
+ * @brief Highest value of a Timer_A counter in the current mode.
+ * @param[in] t: timer.
+ * @return CCR0 in up mode, 0xFFFF otherwise.
+ */
+static unsigned long timer_top(const struct sim_timer *t)
+{
+	if (((*t->ctl & MC_3) == MC_1) && (t->count <= *t->ccr[0]))
+		return *t->ccr[0];
+
+	return 0xFFFF;
+}
+
+/**
+ * @brief Timer_A counts until the next compare or overflow event.
+ * @param[in] t: timer.
+ * @return Counts, at least one, or zero if the timer is stopped.
+ */
+static unsigned long timer_next(const struct sim_timer *t)
+{
+	unsigned long top = timer_top(t);
+	/** Counts to the overflow */
+	unsigned long next = top + 1 - t->count;
+	unsigned long d;
+	unsigned int ccr;
+	int i;
+
+	if (((*t->ctl & MC_3) == MC_0)
+	    || (((*t->ctl & MC_3) == MC_1) && !*t->ccr[0]))
+		return 0;
+
+	for (i = 0; i < 3; i++) {
+		ccr = *t->ccr[i];
+		if (ccr > top)
+			continue;
+		d = (ccr > t->count) ? ccr - t->count
+				     : ccr + top + 1 - t->count;
+		if (d < next)
+			next = d;
+	}
+
+	return next;
+}
+
+/**
+ * @brief Updates the output units in output mode (OUTMOD_0), which follow
+ * their OUT bit.
+ * @param[in,out] t: timer.
+ * @return Void.
+ */
+static void timer_outputs(struct sim_timer *t)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		if ((*t->cctl[i] & OUTMOD_7) == OUTMOD_0)
+			t->out[i] = (*t->cctl[i] & OUT) ? 1 : 0;
+}
+
+/**
+ * @brief Advances a Timer_A, setting the flags of the events on the way.
+ * @param[in,out] t: timer.
+ * @param[in] dt: cycles (SMCLK, no divider).
+ * @return Void.
+ */
+static void timer_run(struct sim_timer *t, unsigned long long dt)
+{
+	unsigned long n;
+	unsigned long top;
+	int i;
+
+	if (*t->ctl & TACLR) {
+		t->count = 0;
+		*t->ctl &= ~TACLR;
+	}
+	/* The registers are 16 bits wide, int is wider on the host */
+	for (i = 0; i < 3; i++)
+		*t->ccr[i] &= 0xFFFF;
+	timer_outputs(t);
+
+	while (dt) {
+		n = timer_next(t);
+		if (!n)
+			break;
+
+		if (dt < n) {
+			t->count += dt;
+			break;
+		}
+		dt -= n;
+
+		top = timer_top(t);
+		t->count = (t->count + n > top) ? 0 : t->count + n;
+
+		if (!t->count)
+			*t->ctl |= TAIFG;
+		for (i = 0; i < 3; i++) {
+			if (t->count != *t->ccr[i])
+				continue;
+			*t->cctl[i] |= CCIFG;
+			if ((*t->cctl[i] & OUTMOD_7) == OUTMOD_4)
+				t->out[i] ^= 1;
+		}
+	}
+
+	*t->r = t->count;
+}
+
+/**
+ * @brief Checks if a Timer_A has its TAxIV interruption pending.
+ * @param[in] t: timer.
+ * @return 1 if CCR1, CCR2 or the overflow flag is set and enabled.
+ */
+static char timer_iv_pending(const struct sim_timer *t)
+{
+	return ((*t->cctl[1] & CCIE) && (*t->cctl[1] & CCIFG))
+		|| ((*t->cctl[2] & CCIE) && (*t->cctl[2] & CCIFG))
+		|| ((*t->ctl & TAIE) && (*t->ctl & TAIFG));
+}
+
+/**
+ * @brief Reads TAxIV: the highest pending flag, which is cleared.
+ * @param[in,out] t: timer.
+ * @return The register.
+ */
+static volatile unsigned int *timer_iv(struct sim_timer *t)
+{
+	if ((*t->cctl[1] & CCIE) && (*t->cctl[1] & CCIFG)) {
+		*t->cctl[1] &= ~CCIFG;
+		t->iv = 0x02;
+	} else if ((*t->cctl[2] & CCIE) && (*t->cctl[2] & CCIFG)) {
+		*t->cctl[2] &= ~CCIFG;
+		t->iv = 0x04;
+	} else if ((*t->ctl & TAIE) && (*t->ctl & TAIFG)) {
+		*t->ctl &= ~TAIFG;
+		t->iv = 0x0A;
+	} else {
+		t->iv = 0;
+	}
+
+	return &t->iv;
+}
+
+/**
+ * @brief Checks if the next line may be sent now.
+ * @return 1 if it may, 0 otherwise.
+ */
+static char host_may_send(void)
+{
+	switch (host_mode) {
+	case SIM_HOST_DONE:
+		return acks >= lines_sent;
+	case SIM_HOST_OK:
+		/* The oldest line does not count, see RX_CREDIT_BYTES */
+		if (acks == lines_sent)
+			return 1;
+		return (lines_sent - acks < sizeof(unacked))
+			&& (credit_used + line_len <= RX_CREDIT_BYTES);
+	default:
+		return 1;
+	}
+}
+
+/**
+ * @brief Next byte from the simulated host.
+ * @return The byte or -1 if there is nothing to send now.
+ */
+static int host_next_byte(void)
+{
+	/** Byte from the pseudo-terminal */
+	unsigned char c;
+
+	if (host_mode == SIM_HOST_PTY)
+		return (read(pty, &c, 1) == 1) ? c : -1;
+
+	if (host_paused || !input)
+		return -1;
+
+	while (line_pos >= line_len) {
+		if (!line_ready) {
+			if (input_eof)
+				return -1;
+			if (!fgets(line, sizeof(line) - 1, input)) {
+				input_eof = 1;
+				return -1;
+			}
+
+			line_len = strcspn(line, "\r\n");
+			if (!line_len)
+				continue;
+
+			/* The null byte terminates the line, not sent yet */
+			line[line_len++] = '\0';
+			line_pos = line_len;
+			line_ready = 1;
+		}
+
+		/* Wait for the previous lines to be performed or acknowledged */
+		if (!host_may_send())
+			return -1;
+
+		if ((host_mode == SIM_HOST_OK) && (lines_sent > acks))
+			credit_used += line_len;
+		unacked[lines_sent % sizeof(unacked)] = line_len;
+		line_ready = 0;
+		line_pos = 0;
+		lines_sent++;
+	}
+
+	return (unsigned char)line[line_pos++];
+}
+
+/**
+ * @brief Handles a byte received by the simulated host.
+ * @param[in] c: byte sent by the firmware.
+ * @return Void.
+ */
+static void host_receive(unsigned char c)
+{
+	last_activity = now;
+	tx_bytes++;
+
+	/* The client handles XON/XOFF, nothing is kept if it does not read */
+	if (host_mode == SIM_HOST_PTY) {
+		if (write(pty, &c, 1) != 1 && errno != EAGAIN)
+			perror("sim: pty");
+		if ((c == XON) || (c == XOFF))
+			return;
+	}
+
+	if (c == XOFF) {
+		host_paused = 1;
+		return;
+	}
+	if (c == XON) {
+		host_paused = 0;
+		return;
+	}
+
+	if (output)
+		fputc(c, output);
+
+	memmove(tail, tail + 1, sizeof(tail) - 1);
+	tail[sizeof(tail) - 1] = c;
+
+	/*
+	 * "ok P" or "done" acknowledges the oldest line once its reply ends,
+	 * it may follow the echo of its line, on the same reply line
+	 */
+	if (!memcmp(tail + 1, "ok P", sizeof(tail) - 1)
+	    || !memcmp(tail, "done\n", sizeof(tail)))
+		rx_ok = 1;
+	if (c == '\n') {
+		if (rx_ok && (acks < lines_sent)) {
+			acks++;
+			/* The next oldest line does not count anymore */
+			if ((host_mode == SIM_HOST_OK) && (acks < lines_sent))
+				credit_used -= unacked[acks % sizeof(unacked)];
+		}
+		rx_ok = 0;
+	}
+}
+
+/**
+ * @brief Updates the UART shift registers.
+ * @return Void.
+ */
+static void uart_run(void)
+{
+	/** Byte to be received */
+	int c;
+
+	if (tx_written) {
+		tx_written = 0;
+		if (tx_shifting) {
+			txbuf_full = 1;
+			ifg2 &= ~UCA0TXIFG;
+		} else {
+			tx_shift = uca0txbuf;
+			tx_shifting = 1;
+			tx_done_at = now + char_cycles();
+			uca0stat |= UCBUSY;
+			ifg2 |= UCA0TXIFG;
+		}
+	}
+
+	if (tx_shifting && (now >= tx_done_at)) {
+		host_receive(tx_shift);
+		if (txbuf_full) {
+			txbuf_full = 0;
+			tx_shift = uca0txbuf;
+			tx_done_at = now + char_cycles();
+			ifg2 |= UCA0TXIFG;
+		} else {
+			tx_shifting = 0;
+			uca0stat &= ~UCBUSY;
+		}
+	}
+
+	if (rx_shifting && (now >= rx_done_at)) {
+		rx_shifting = 0;
+		if (ifg2 & UCA0RXIFG) {
+			uca0stat |= UCOE;
+			overruns++;
+		}
+		uca0rxbuf = rx_shift;
+		ifg2 |= UCA0RXIFG;
+	}
+
+	if (!rx_shifting && !(UCA0CTL1 & UCSWRST)) {
+		c = host_next_byte();
+		if (c >= 0) {
+			rx_shift = c;
+			rx_shifting = 1;
+			rx_done_at = now + char_cycles();
+			last_activity = now;
+		}
+	}
+}
+
+/**
+ * @brief Level of a pin.
+ * @param[in] port: P1OUT or P2OUT.
+ * @param[in] mask: pin mask.
+ * @param[in] p1: port 1 pins.
+ * @param[in] p2: port 2 pins, the timer outputs included.
+ * @return 1 if high, 0 if low.
+ */
+static unsigned char pin_level(volatile unsigned char *port, unsigned char mask,
+			       unsigned char p1, unsigned char p2)
+{
+	return (((port == &P1OUT) ? p1 : p2) & mask) ? 1 : 0;
+}
+
+/**
+ * @brief Updates the step statistics of an axis after a change of its pins.
+ * @param[in,out] t: axis statistics.
+ * @param[in] dir: the direction pin changed, otherwise the step pin.
+ * @return Void.
+ */
+static void trace_edge(struct sim_trace_axis *t, char dir)
+{
+	unsigned long long dt;
+
+	if (dir) {
+		t->dir_at = now;
+		t->dir_pending = 1;
+		return;
+	}
+
+	if (t->dir_pending && (now - t->dir_at < t->setup_min))
+		t->setup_min = now - t->dir_at;
+	t->dir_pending = 0;
+
+	/* Each edge is a step, see pins_run */
+	if (t->steps) {
+		dt = now - t->last;
+		if (dt < t->min)
+			t->min = dt;
+		if (dt <= SIM_TRACE_GAP_MS * (SMCLK_HZ / 1000)) {
+			t->moving += dt;
+			t->moving_steps++;
+		}
+	}
+	t->steps++;
+	t->last = now;
+}
+
+/**
+ * @brief Writes the changes of the traced pins.
+ * @param[in] p1: port 1 pins.
+ * @param[in] p2: port 2 pins, the timer outputs included.
+ * @return Void.
+ */
+static void trace_pins(unsigned char p1, unsigned char p2)
+{
+	unsigned char v[SIM_TRACE_PINS];
+	const struct axis_desc *a;
+	int i;
+
+	for (i = 0; i < DDA_AXES; i++) {
+		a = &axes[i];
+		v[2*i] = pin_level(a->step_port, a->step_mask, p1, p2);
+		v[2*i + 1] = pin_level(a->dir_port, a->dir_mask, p1, p2);
+	}
+	v[2*DDA_AXES] = (p2 & VACUUM) ? 1 : 0;
+
+	for (i = 0; i < SIM_TRACE_PINS; i++) {
+		if (v[i] == trace_last[i])
+			continue;
+		trace_last[i] = v[i];
+
+		if (now != trace_at) {
+			fprintf(trace, "#%llu\n", now * SIM_TRACE_NS);
+			trace_at = now;
+		}
+		fprintf(trace, "%u%c\n", v[i], '!' + i);
+
+		if (i < 2*DDA_AXES)
+			trace_edge(&trace_axes[i / 2], i % 2);
+	}
+}
+
+/**
+ * @brief Writes the step rates of each axis to the standard error and closes
+ * the trace.
+ * @return Void.
+ */
+static void trace_report(void)
+{
+	const struct sim_trace_axis *t;
+	int i;
+
+	fprintf(trace, "#%llu\n", now * SIM_TRACE_NS);
+	fclose(trace);
+	trace = NULL;
+
+	for (i = 0; i < DDA_AXES; i++) {
+		t = &trace_axes[i];
+		fprintf(stderr, "trace: %c %lu steps", axes[i].letter, t->steps);
+		if (t->moving)
+			fprintf(stderr, ", %llu/s mean",
+				t->moving_steps * SMCLK_HZ / t->moving);
+		if (t->min != ~0ULL)
+			fprintf(stderr, ", %llu/s peak", SMCLK_HZ / t->min);
+		if (t->setup_min != ~0ULL)
+			fprintf(stderr, ", dir setup %llu cycles",
+				t->setup_min);
+		fprintf(stderr, "\n");
+	}
+}
+
+/**
+ * @brief Moves the axes following the step pins and updates the endstops.
+ * @return Void.
+ */
+static void pins_run(void)
+{
+	/** Endstops inputs, high when triggered */
+	unsigned char sw1 = 0;
+	unsigned char sw2 = 0;
+	unsigned char in;
+	unsigned char p1 = P1OUT;
+	unsigned char p2 = P2OUT;
+	const struct axis_desc *a;
+	const struct sim_timer_pin *tp;
+	int i;
+
+	/* Pins driven by the timer output units */
+	for (i = 0; i < (int)(sizeof(timer_pins) / sizeof(timer_pins[0])); i++) {
+		tp = &timer_pins[i];
+		if (!(P2SEL & tp->mask) || (P2SEL2 & tp->mask))
+			continue;
+		timer_outputs(&timers[tp->timer]);
+		if (timers[tp->timer].out[tp->unit])
+			p2 |= tp->mask;
+		else
+			p2 &= ~tp->mask;
+	}
+
+	for (i = 0; i < DDA_AXES; i++) {
+		a = &axes[i];
+		if (!(((a->step_port == &P1OUT) ? p1 ^ p1_last : p2 ^ p2_last)
+		      & a->step_mask))
+			continue;
+
+		if ((*a->dir_port & a->dir_mask) == a->dir_pos)
+			pos[i]++;
+		else
+			pos[i]--;
+		last_activity = now;
+	}
+	p1_last = p1;
+	p2_last = p2;
+
+	if (trace)
+		trace_pins(p1, p2);
+
+	if (pos[AXIS_X] <= 0)
+		sw1 |= SWX;
+	if (pos[AXIS_Y] <= 0)
+		sw1 |= SWY;
+	if (pos[AXIS_Z] <= 0)
+		sw2 |= SWZ;
+
+	/* Edge select: zero for rising edges, one for falling edges */
+	in = (p1 & P1DIR) | (sw1 & ~P1DIR);
+	P1IFG |= ((in & ~P1IN & ~P1IES) | (~in & P1IN & P1IES)) & ~P1DIR;
+	P1IN = in;
+
+	in = (p2 & P2DIR) | (sw2 & ~P2DIR);
+	P2IFG |= ((in & ~P2IN & ~P2IES) | (~in & P2IN & P2IES)) & ~P2DIR;
+	P2IN = in;
+}
+
+/**
+ * @brief Calls an interruption handler as the CPU would.
+ * @param[in] irq: interruption source.
+ * @param[in] isr: handler.
+ * @return Void.
+ */
+static void call_isr(enum sim_irq irq, void (*isr)(void))
+{
+	/** Status register pushed to the stack */
+	unsigned int saved = sr;
+	unsigned int *prev = isr_sr;
+	/** Time of the request */
+	unsigned long long start = now;
+
+	sr = 0;
+	isr_sr = &saved;
+	sim_advance(SIM_ISR_CYCLES);
+	isr();
+	uart_run();
+	pins_run();
+	isr_sr = prev;
+	sr = saved;
+
+	irq_stats[irq].calls++;
+	irq_stats[irq].cycles += now - start;
+	if (now - start > irq_stats[irq].max)
+		irq_stats[irq].max = now - start;
+}
+
+/**
+ * @brief Runs the pending interruptions by priority while they are enabled.
+ * @return Void.
+ */
+static void dispatch(void)
+{
+	while (sr & GIE) {
+		if ((TA1CCTL0 & CCIE) && (TA1CCTL0 & CCIFG)) {
+			TA1CCTL0 &= ~CCIFG;
+			call_isr(SIM_IRQ_TIMER1_A0, step_ISR);
+		} else if ((TA0CCTL0 & CCIE) && (TA0CCTL0 & CCIFG)) {
+			TA0CCTL0 &= ~CCIFG;
+			call_isr(SIM_IRQ_TIMER0_A0, report_ISR);
+		} else if (timer_iv_pending(&timers[0])) {
+			call_isr(SIM_IRQ_TIMER0_A1, clock_ISR);
+		} else if ((IE2 & UCA0RXIE) && (ifg2 & UCA0RXIFG)) {
+			if (((rx_head + 1) & (RX_RING_SIZE - 1)) == rx_tail)
+				ring_drops++;
+			call_isr(SIM_IRQ_USCI_RX, received_data_ISR);
+		} else if ((IE2 & UCA0TXIE) && (ifg2 & UCA0TXIFG)) {
+			call_isr(SIM_IRQ_USCI_TX, transmit_data_ISR);
+		} else if (P2IE & P2IFG) {
+			call_isr(SIM_IRQ_PORT2, port2_ISR);
+		} else if (P1IE & P1IFG) {
+			call_isr(SIM_IRQ_PORT1, port1_ISR);
+		} else {
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Keeps the virtual time from running ahead of the wall clock, so the
+ * UART of a pseudo-terminal client runs at its real rate.
+ * @return Void.
+ */
+static void pty_pace(void)
+{
+	/** Wall clock */
+	struct timespec ts;
+	/** Wall clock time since the pseudo-terminal was opened, in cycles */
+	unsigned long long wall;
+	/** Virtual time ahead of the wall clock */
+	unsigned long long ahead;
+
+	if (now < pty_pace_at)
+		return;
+	pty_pace_at = now + SIM_PACE_MS * (SMCLK_HZ / 1000);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	wall = (unsigned long long)(ts.tv_sec - pty_start.tv_sec) * SMCLK_HZ
+		+ ((long long)ts.tv_nsec - pty_start.tv_nsec)
+		* (long long)(SMCLK_HZ / 1000) / 1000000;
+	if (now <= wall)
+		return;
+
+	ahead = now - wall;
+	ts.tv_sec = ahead / SMCLK_HZ;
+	ts.tv_nsec = (ahead % SMCLK_HZ) * 1000 / (SMCLK_HZ / 1000000);
+	nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief Ends the simulation when the input was performed, the time limit
+ * is reached or #sim_stop was called.
+ * @return Void.
+ */
+static void check_end(void)
+{
+	if (stop)
+		exit(EXIT_SUCCESS);
+
+	if (time_limit && (now >= time_limit)) {
+		fprintf(stderr, "sim: time limit reached\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Lines lost on the way fail the run, whatever the mode */
+	if (input_eof && !line_ready && ((host_mode == SIM_HOST_STREAM)
+	    || (((host_mode == SIM_HOST_DONE) || (host_mode == SIM_HOST_OK))
+		&& (acks >= lines_sent)))
+	    && !rx_shifting && !tx_shifting
+	    && (now - last_activity >= SIM_QUIET_MS * (SMCLK_HZ / 1000)))
+		exit((overruns || ring_drops) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/**
+ * @brief Advances the time to the next event, no further than a limit, and
+ * updates everything.
+ * @param[in] limit: time limit in cycles.
+ * @return Void.
+ */
+static void step(unsigned long long limit)
+{
+	unsigned long long next = limit;
+	unsigned long t;
+	unsigned int i;
+
+	for (i = 0; i < SIM_TIMERS; i++) {
+		timer_run(&timers[i], 0);
+		t = timer_next(&timers[i]);
+		if (t && (now + t < next))
+			next = now + t;
+	}
+	if (tx_shifting && (tx_done_at < next))
+		next = tx_done_at;
+	if (rx_shifting && (rx_done_at < next))
+		next = rx_done_at;
+	if (next < now)
+		next = now;
+
+	for (i = 0; i < SIM_TIMERS; i++)
+		timer_run(&timers[i], next - now);
+	now = next;
+
+	uart_run();
+	pins_run();
+	dispatch();
+	if (pty >= 0)
+		pty_pace();
+	check_end();
+}
+
+void sim_advance(unsigned long cycles)
+{
+	unsigned long long target = now + cycles;
+
+	do {
+		step(target);
+	} while (now < target);
+}
+
+unsigned long long sim_cycles(void)
+{
+	return now;
+}
+
+long sim_position(unsigned char axis)
+{
+	return pos[axis];
+}
+
+unsigned long sim_tx_bytes(void)
+{
+	return tx_bytes;
+}
+
+char sim_tx_idle(void)
+{
+	return !tx_written && !tx_shifting && !(IE2 & UCA0TXIE);
+}
+
+struct sim_irq_stats sim_irq_stats(enum sim_irq irq)
+{
+	return irq_stats[irq];
+}
+
+void sim_set_input(FILE *f, enum sim_host mode)
+{
+	input = f;
+	host_mode = mode;
+
+	/*
+	 * The first line switches the acknowledgements to "ok", or XON/XOFF
+	 * on, which the streamed lines need not to overrun the RX ring
+	 */
+	if (mode == SIM_HOST_OK) {
+		strcpy(line, "M14");
+		line_len = sizeof("M14");
+		line_pos = line_len;
+		line_ready = 1;
+	} else if (mode == SIM_HOST_STREAM) {
+		strcpy(line, "M575 S1");
+		line_len = sizeof("M575 S1");
+		line_pos = line_len;
+		line_ready = 1;
+	}
+}
+
+int sim_trace_open(const char *path)
+{
+	/** Names of the traced pins, by #trace_last index */
+	static const char *const kinds[] = {"step", "dir"};
+	int i;
+
+	trace = fopen(path, "w");
+	if (!trace) {
+		perror(path);
+		return -1;
+	}
+
+	fprintf(trace, "$version pnp_control_sim $end\n"
+		"$timescale 1 ns $end\n$scope module pnp $end\n");
+	for (i = 0; i < 2*DDA_AXES; i++)
+		fprintf(trace, "$var wire 1 %c %s_%c $end\n", '!' + i,
+			kinds[i % 2], axes[i / 2].letter);
+	fprintf(trace, "$var wire 1 %c vacuum $end\n", '!' + 2*DDA_AXES);
+	fprintf(trace, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+	for (i = 0; i < SIM_TRACE_PINS; i++)
+		fprintf(trace, "%u%c\n", trace_last[i], '!' + i);
+	fprintf(trace, "$end\n");
+	trace_at = now;
+
+	for (i = 0; i < DDA_AXES; i++) {
+		trace_axes[i].min = ~0ULL;
+		trace_axes[i].setup_min = ~0ULL;
+	}
+
+	return 0;
+}
+
+int sim_open_pty(void)
+{
+	/** Slave side, kept open so the clients may come and go */
+	int slave;
+	struct termios tio;
+
+	pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if ((pty < 0) || grantpt(pty) || unlockpt(pty)
+	    || ((slave = open(ptsname(pty), O_RDWR | O_NOCTTY)) < 0)) {
+		perror("sim: pty");
+		return -1;
+	}
+
+	/* Nothing is translated, the null bytes end the lines */
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	fprintf(stderr, "sim: pty %s\n", ptsname(pty));
+	host_mode = SIM_HOST_PTY;
+	clock_gettime(CLOCK_MONOTONIC, &pty_start);
+
+	return 0;
+}
+
+void sim_stop(void)
+{
+	stop = 1;
+}
+
+void sim_set_output(FILE *f)
+{
+	output = f;
+}
+
+void sim_set_time_limit(unsigned long seconds)
+{
+	time_limit = (unsigned long long)seconds * SMCLK_HZ;
+}
+
+volatile unsigned char *sim_ifg2(void)
+{
+	sim_advance(SIM_IO_CYCLES);
+	return &ifg2;
+}
+
+volatile unsigned char *sim_uca0stat(void)
+{
+	sim_advance(SIM_IO_CYCLES);
+	return &uca0stat;
+}
+
+volatile unsigned char *sim_uca0rxbuf(void)
+{
+	/* Reading the buffer clears the flags */
+	ifg2 &= ~UCA0RXIFG;
+	uca0stat &= ~UCOE;
+	return &uca0rxbuf;
+}
+
+volatile unsigned char *sim_uca0txbuf(void)
+{
+	/* Never read by the firmware, any access is a write */
+	tx_written = 1;
+	return &uca0txbuf;
+}
+
+volatile unsigned int *sim_ta0iv(void)
+{
+	return timer_iv(&timers[0]);
+}
+
+volatile unsigned int *sim_ta1iv(void)
+{
+	return timer_iv(&timers[1]);
+}
+
+void __delay_cycles(unsigned long cycles)
+{
+	sim_advance(cycles);
+}
+
+unsigned int __get_SR_register(void)
+{
+	return sr;
+}
+
+void __bis_SR_register(unsigned int bits)
+{
+	sr |= bits;
+	step(now);
+
+	/* Low power mode: sleep until a handler clears CPUOFF on exit */
+	while (sr & CPUOFF)
+		step(now + SMCLK_HZ / 1000);
+}
+
+void __bic_SR_register(unsigned int bits)
+{
+	sr &= ~bits;
+}
+
+void __bis_SR_register_on_exit(unsigned int bits)
+{
+	if (isr_sr)
+		*isr_sr |= bits;
+}
+
+void __bic_SR_register_on_exit(unsigned int bits)
+{
+	if (isr_sr)
+		*isr_sr &= ~bits;
+}
+
+void __enable_interrupt(void)
+{
+	sr |= GIE;
+	step(now);
+}
+
+void __disable_interrupt(void)
+{
+	sr &= ~GIE;
+}
+
+void __no_operation(void)
+{
+	sim_advance(1);
+}
+
+/* Called on every firmware function call (-finstrument-functions) */
+void __cyg_profile_func_enter(void *fn, void *site)
+{
+	(void)fn;
+	(void)site;
+	sim_advance(SIM_CALL_CYCLES);
+}
+
+/* Called on every firmware basic block (-fsanitize-coverage=trace-pc) */
+void __sanitizer_cov_trace_pc(void)
+{
+	sim_advance(SIM_BLOCK_CYCLES);
+}
+
+void __cyg_profile_func_exit(void *fn, void *site)
+{
+	(void)fn;
+	(void)site;
+}
+
+void sim_report(void)
+{
+	int i;
+
+	if (output)
+		fflush(output);
+	fprintf(stderr, "sim: %llu cycles (%llu.%06llu s)", now,
+		now / SMCLK_HZ, (now % SMCLK_HZ) * 1000000 / SMCLK_HZ);
+	for (i = 0; i < DDA_AXES; i++)
+		fprintf(stderr, " %c %ld", axes[i].letter, pos[i]);
+	fprintf(stderr, " steps\n");
+	if (overruns)
+		fprintf(stderr, "sim: %lu bytes lost (RX overrun)\n", overruns);
+	if (ring_drops)
+		fprintf(stderr, "sim: %lu bytes dropped (RX ring full)\n",
+			ring_drops);
+	if (trace)
+		trace_report();
+}
+
+void sim_reset(void)
+{
+	int i;
+
+	for (i = AXIS_X; i <= AXIS_Z; i++)
+		pos[i] = (long)SIM_HOME_DIST_MM * axes[i].steps_per_unit;
+	pins_run();
+}
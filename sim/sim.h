@@ -0,0 +1,228 @@
+/**
+ * @file
+ * @brief Defines the MSP430G2553 simulator used by the host build.
+ *
+ * The firmware runs unmodified on the host: the registers of msp430.h are
+ * simulated, the virtual time advances by #SIM_CALL_CYCLES on every firmware
+ * function call (-finstrument-functions), by #SIM_BLOCK_CYCLES on every basic
+ * block (-fsanitize-coverage=trace-pc), by #SIM_IO_CYCLES on every access to
+ * a simulated register and by the requested amount in __delay_cycles. The
+ * ports, Timer0_A3, Timer1_A3 (output units in output and toggle modes) and
+ * the USCI_A0 UART are updated as the time advances and the interruptions are
+ * dispatched to the firmware handlers when enabled.
+ *
+ * A simulated host sends the input lines through the UART and the machine
+ * axes follow the step and direction pins, triggering the endstops at zero.
+ * Everything is deterministic: the same input always gives the same output
+ * and the same virtual time. A host program may also drive the firmware
+ * through a pseudo-terminal (#sim_open_pty), then the virtual time is paced
+ * by the wall clock and depends on the host timing.
+ *
+ * The cycle model is coarse: the libgcc multiplication and division routines
+ * of the MSP430 (no hardware multiplier) are native instructions on the host
+ * and are not charged, so the cycles are a lower bound, meant to compare
+ * versions of the firmware. The step interruption does not call them, its
+ * ramp divides in firmware code (#ramp_next), which is charged.
+ *
+ * The firmware runs on the host stack and the device stack is not modelled:
+ * the RAM painted by #stack_paint is never reached, #stack_free reports no
+ * byte used. The deepest device stack is checked by make ram, from the frames
+ * of the device build.
+ * @author Davi Antônio da Silva Santos
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdio.h>
+#include "stepper.h"
+
+/** Cycles spent by each firmware function call and return */
+#define SIM_CALL_CYCLES (10)
+/** Cycles spent by each basic block (about three instructions) */
+#define SIM_BLOCK_CYCLES (6)
+/** Cycles spent by each access to a simulated register */
+#define SIM_IO_CYCLES (4)
+/** Cycles of an interruption entry and return (RETI) */
+#define SIM_ISR_CYCLES (11)
+/** Distance of the X, Y and Z axes to their endstops at reset, in mm */
+#define SIM_HOME_DIST_MM (10)
+/** The simulation ends after the input and this time without activity */
+#define SIM_QUIET_MS (50)
+/** Default virtual time limit in seconds */
+#define SIM_TIME_LIMIT_S (600)
+/** Most virtual time run ahead of the wall clock with a pseudo-terminal */
+#define SIM_PACE_MS (1)
+/** Pins in the trace: step and direction of each axis and the vacuum */
+#define SIM_TRACE_PINS (2*DDA_AXES + 1)
+/** Nanoseconds per cycle, the trace time unit is 1 ns */
+#define SIM_TRACE_NS (1000000000ULL / SMCLK_HZ)
+/**
+ * Steps further apart than this are pauses between moves, left out of the
+ * mean step rate of the trace
+ */
+#define SIM_TRACE_GAP_MS (20)
+/**
+ * Bytes between the variables and the top of the RAM (#stack_free), the
+ * stack reserve of the device
+ */
+#define SIM_STACK_BYTES (STACK_BYTES)
+/** Expands a macro and turns it into a string */
+#define SIM_STR(x) SIM_STR_(x)
+#define SIM_STR_(x) #x
+
+/** Interruption sources with a handler, by decreasing priority */
+enum sim_irq {
+	SIM_IRQ_TIMER1_A0,
+	SIM_IRQ_TIMER0_A0,
+	SIM_IRQ_TIMER0_A1,
+	SIM_IRQ_USCI_RX,
+	SIM_IRQ_USCI_TX,
+	SIM_IRQ_PORT2,
+	SIM_IRQ_PORT1,
+	SIM_IRQS
+};
+
+/** How the simulated host sends the input lines, see #sim_set_input */
+enum sim_host {
+	/** Each line after "done" is received for the previous one */
+	SIM_HOST_DONE,
+	/** All lines, obeying XON/XOFF */
+	SIM_HOST_STREAM,
+	/**
+	 * Counting the characters of the lines not acknowledged by "ok" yet
+	 * (#RX_CREDIT_BYTES), after sending M14
+	 */
+	SIM_HOST_OK,
+	/**
+	 * Whatever a client sends through a pseudo-terminal (#sim_open_pty),
+	 * the virtual time following the wall clock
+	 */
+	SIM_HOST_PTY
+};
+
+/**
+ * @brief Statistics of one interruption handler.
+ */
+struct sim_irq_stats {
+	/** Number of calls */
+	unsigned long calls;
+	/** Cycles from the requests to the returns, nested time included */
+	unsigned long long cycles;
+	/** Longest call in cycles, nested time included */
+	unsigned long max;
+};
+
+/**
+ * @brief Firmware entry point, the firmware main function is renamed by the
+ * host build.
+ * @return Never returns.
+ */
+int firmware_main(void);
+
+/**
+ * @brief Virtual time since reset.
+ * @return MCLK/SMCLK cycles since reset.
+ */
+unsigned long long sim_cycles(void);
+
+/**
+ * @brief Position of an axis given by its step and direction pins.
+ * @param[in] axis: axis index (#axis_id).
+ * @return Position in steps, zero is the endstop of X, Y and Z.
+ */
+long sim_position(unsigned char axis);
+
+/**
+ * @brief Bytes sent by the firmware through the UART.
+ * @return Bytes since reset, XON/XOFF included.
+ */
+unsigned long sim_tx_bytes(void);
+
+/**
+ * @brief Checks if the UART transmitter has nothing left to send.
+ * @return 1 if idle and its interruption disabled, 0 otherwise.
+ */
+char sim_tx_idle(void);
+
+/**
+ * @brief Statistics of an interruption handler.
+ * @param[in] irq: interruption source.
+ * @return Calls and cycles since reset.
+ */
+struct sim_irq_stats sim_irq_stats(enum sim_irq irq);
+
+/**
+ * @brief Sets the input of the simulated host.
+ * @param[in] f: G-code lines, each one sent followed by a null byte. NULL
+ * sends nothing.
+ * @param[in] mode: how the lines are sent.
+ * @return Void.
+ */
+void sim_set_input(FILE *f, enum sim_host mode);
+
+/**
+ * @brief Sets where the bytes sent by the firmware are written, XON/XOFF
+ * excluded.
+ * @param[in] f: output file, NULL discards them.
+ * @return Void.
+ */
+void sim_set_output(FILE *f);
+
+/**
+ * @brief Records the step, direction and vacuum pins to a VCD file, the
+ * timer outputs included, with the virtual time of each change (to within a
+ * basic block for the pins written by the firmware). The step rates of each
+ * axis and the shortest time from a direction change to the next step are
+ * written by #sim_report.
+ * @param[in] path: VCD file.
+ * @return 0 on success, -1 on error.
+ */
+int sim_trace_open(const char *path);
+
+/**
+ * @brief Opens a pseudo-terminal and makes it the simulated host
+ * (#SIM_HOST_PTY), its name is written to the standard error. The firmware
+ * replies are sent to it, XON/XOFF included. The simulation only ends with
+ * the time limit or #sim_stop.
+ * @return 0 on success, -1 on error.
+ */
+int sim_open_pty(void);
+
+/**
+ * @brief Ends the simulation at the next update, may be called by a signal
+ * handler.
+ * @return Void.
+ */
+void sim_stop(void);
+
+/**
+ * @brief Sets the virtual time limit, the simulation fails when it is
+ * reached (default #SIM_TIME_LIMIT_S).
+ * @param[in] seconds: limit in seconds, zero for none.
+ * @return Void.
+ */
+void sim_set_time_limit(unsigned long seconds);
+
+/**
+ * @brief Places the X, Y and Z axes #SIM_HOME_DIST_MM from their endstops.
+ * @return Void.
+ */
+void sim_reset(void);
+
+/**
+ * @brief Writes the virtual time and the axes positions to the standard
+ * error, then the step rates and closes the trace if any.
+ * @return Void.
+ */
+void sim_report(void);
+
+/**
+ * @brief Advances the virtual time, updating the peripherals and running the
+ * enabled interruptions. Called by the intrinsics and the instrumentation.
+ * @param[in] cycles: cycles to advance.
+ * @return Void.
+ */
+void sim_advance(unsigned long cycles);
+
+#endif
@@ -0,0 +1,95 @@
+/**
+ * @file
+ * @brief Runs the firmware on the simulator (see sim.h).
+ *
+ * Usage: pnp_control_sim [-s | -k | -p] [-t seconds] [-v trace.vcd] [file]
+ *
+ * The lines of the file (or of the standard input) are sent to the firmware,
+ * each one terminated by a null byte. By default the next line is only sent
+ * after "done" is received for the previous one; with -s M575 S1 is sent
+ * first and the lines are streamed, obeying XON/XOFF; with -k M14 is sent
+ * first and the lines are streamed counting the characters not acknowledged by
+ * "ok" yet. Everything the firmware sends is written to the standard output
+ * and a summary is written to the standard error at the end. The exit status
+ * is non-zero if a byte was lost, by an RX overrun or a full RX ring. With -p
+ * the lines come from a client of a pseudo-terminal instead (tools/stream.c),
+ * in real time and without time limit unless -t is given, until SIGINT or
+ * SIGTERM. With -v the step, direction and vacuum pins are recorded to a VCD
+ * file.
+ * @author Davi Antônio da Silva Santos
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "sim.h"
+
+/**
+ * @brief Ends the simulation, its summary included.
+ * @param[in] sig: signal number.
+ * @return Void.
+ */
+static void on_signal(int sig)
+{
+	(void)sig;
+	sim_stop();
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	/** Simulated host input */
+	FILE *input = stdin;
+	/** Stream the lines instead of waiting for "done" */
+	enum sim_host mode = SIM_HOST_DONE;
+	/** Time limit given */
+	char limit = 0;
+
+	while ((opt = getopt(argc, argv, "skpt:v:")) != -1) {
+		switch (opt) {
+		case 's':
+			mode = SIM_HOST_STREAM;
+			break;
+		case 'k':
+			mode = SIM_HOST_OK;
+			break;
+		case 'p':
+			mode = SIM_HOST_PTY;
+			break;
+		case 't':
+			sim_set_time_limit(strtoul(optarg, NULL, 10));
+			limit = 1;
+			break;
+		case 'v':
+			if (sim_trace_open(optarg))
+				return EXIT_FAILURE;
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-s | -k | -p] [-t seconds] "
+				"[-v trace.vcd] [file]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (mode == SIM_HOST_PTY) {
+		if (sim_open_pty())
+			return EXIT_FAILURE;
+		if (!limit)
+			sim_set_time_limit(0);
+		signal(SIGINT, on_signal);
+		signal(SIGTERM, on_signal);
+	} else if ((optind < argc) && !(input = fopen(argv[optind], "r"))) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	} else {
+		sim_set_input(input, mode);
+	}
+
+	sim_set_output(stdout);
+	sim_reset();
+	atexit(sim_report);
+
+	return firmware_main();
+}
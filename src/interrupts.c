@@ -11,71 +11,248 @@
 #include "usart.h"
 #include "timers.h"
 #include "sys_control.h"
+#include "planner.h"
+#include "stepper.h"
 
 void __attribute__ ((interrupt(USCIAB0RX_VECTOR))) received_data_ISR (void)
 {
-	volatile char c;
-	/** Automatically initialized as zero */
-	static int i;
+	/** Clock at the entry, for #isr_cycles */
+	unsigned int t0 = TA0R;
+	/** Received character */
+	char c;
+	/** Next head position */
+	unsigned char next;
 
-	/* Store character in buffer */
+	/* Store character in the ring, drop it if the ring is full */
 	c = UCA0RXBUF;
-	rx_data_raw[i] = c;
-
-	/*
-	 * Check if any transmission is still happening 
-	 * Echo received character
-	 */
-	while (!(IFG2 & UCA0TXIFG));
-	UCA0TXBUF = UCA0RXBUF;
-	/* Wait while UART is transmitting the byte */
-	while (UCA0STAT & UCBUSY);
-
-	/*
-	 * if counter is greater than maximum size or '\0' was
-	 * sent, allow the rx buffer to be validated. Otherwise
-	 * it will increment the counter in order to fill the 
-	 * next byte
-	 */
-	if ((i >= RX_STR_SIZE) || (c == '\0') || (c == ';') || (c == '*')
-		|| (c == '(')) {
-		i = 0;
-		execute_routine = 1;
-	} else {
-		i++;
+	next = (rx_head + 1) & (RX_RING_SIZE - 1);
+	if (next != rx_tail) {
+		rx_ring[rx_head] = c;
+		rx_head = next;
+	}
+
+	/* Ask the host to stop before the ring overruns */
+	if (uart_xonxoff && !rx_xoff && (((rx_head - rx_tail)
+		& (RX_RING_SIZE - 1)) >= RX_XOFF_LEVEL)) {
+		rx_xoff = 1;
+		tx_flow = XOFF;
+		IE2 |= UCA0TXIE;
 	}
+
+	/* The main loop has something to read */
+	__bic_SR_register_on_exit(IDLE_LPM_BITS);
+	isr_cycles += CLOCK_SINCE(t0);
+}
+
+void __attribute__ ((interrupt(USCIAB0TX_VECTOR))) transmit_data_ISR (void)
+{
+	/** Clock at the entry, for #isr_cycles */
+	unsigned int t0 = TA0R;
+
+	/* XON/XOFF go before the queued data */
+	if (tx_flow) {
+		UCA0TXBUF = tx_flow;
+		tx_flow = 0;
+	} else if (tx_count) {
+		UCA0TXBUF = tx_ring[tx_tail];
+		tx_tail = (tx_tail + 1) & (TX_RING_SIZE - 1);
+		tx_count--;
+	}
+
+	if (!tx_count && !tx_flow)
+		IE2 &= ~UCA0TXIE;
+
+	isr_cycles += CLOCK_SINCE(t0);
+}
+
+/**
+ * @brief Stops the homing axes whose endstop was triggered (see #home_axes)
+ * and the move when no axis is left.
+ * @param[in] hit: axes whose endstop was triggered, bit n for #axis_id n.
+ * @return Void.
+ */
+static void home_endstops(unsigned char hit)
+{
+	/** Axis counter */
+	unsigned char i;
+	
+	hit &= home_axes;
+	for (i = AXIS_X; i <= AXIS_Z; i++)
+		if (hit & (1 << i))
+			stepper_halt(i);
+	
+	home_axes &= ~hit;
+	if (!home_axes)
+		stepper_abort();
 }
 
 void __attribute__ ((interrupt(PORT1_VECTOR))) port1_ISR (void)
 {
-	/* Endstop sensor was triggered, kill the motors */
-	stop_t1_a3_c0();
+	/** Clock at the entry, for #isr_cycles */
+	unsigned int t0 = TA0R;
+	/** Axes whose endstop was triggered */
+	unsigned char hit = 0;
 
-	curr_status.end_triggd = 1;
+	if (P1IFG & SWX)
+		hit |= 1 << AXIS_X;
+	if (P1IFG & SWY)
+		hit |= 1 << AXIS_Y;
 
-	curr_status.calibrated = 0;
-	req_status.error = 1;
-	curr_status.error = 1;
+	if (home_axes) {
+		/* Homing: only the axis of the endstop stops */
+		home_endstops(hit);
+	} else {
+		/*
+		 * Endstop sensor was triggered, kill the motors. The step
+		 * counters keep the position, #move reports it.
+		 */
+		stepper_abort();
+		end_hit |= hit;
 
-	if (curr_status.end_triggd)
-		send_string("E H\n");
+		curr_status.end_triggd = 1;
+		curr_status.error = 1;
+	}
 
 	P1IFG = 0;
+	__bic_SR_register_on_exit(IDLE_LPM_BITS);
+	isr_cycles += CLOCK_SINCE(t0);
 }
 
 void __attribute__ ((interrupt(PORT2_VECTOR))) port2_ISR (void)
 {
-	/* Endstop sensor was triggered, kill the motors */
-	stop_t1_a3_c0();
+	/** Clock at the entry, for #isr_cycles */
+	unsigned int t0 = TA0R;
+	/** Axes whose endstop was triggered */
+	unsigned char hit = 0;
 
-	curr_status.end_triggd = 1;
+	if (P2IFG & SWZ)
+		hit |= 1 << AXIS_Z;
 
-	curr_status.calibrated = 0;
-	req_status.error = 1;
-	curr_status.error = 1;
+	if (home_axes) {
+		/* Homing: only the axis of the endstop stops */
+		home_endstops(hit);
+	} else {
+		/*
+		 * Endstop sensor was triggered, kill the motors. The step
+		 * counters keep the position, #move reports it.
+		 */
+		stepper_abort();
+		end_hit |= hit;
 
-	if (curr_status.end_triggd)
-		send_string("E H\n");
+		curr_status.end_triggd = 1;
+		curr_status.error = 1;
+	}
 
 	P2IFG = 0;
+	__bic_SR_register_on_exit(IDLE_LPM_BITS);
+	isr_cycles += CLOCK_SINCE(t0);
+}
+
+void __attribute__ ((interrupt(TIMER1_A0_VECTOR))) step_ISR (void)
+{
+	/** Timer counts since the CCR0 event, read just before the step pins */
+	unsigned int lat = TA1R;
+	/** Clock at the entry, for #isr_cycles */
+	unsigned int t0 = TA0R;
+	/** Axis being interpolated */
+	struct dda_axis *a;
+	/** Axis counter */
+	unsigned char i;
+	/** Period of the next event */
+	unsigned int period;
+#if !STEP_TIMER_OUTPUTS
+	/** The iteration of this event moved sqrt(2) grid steps */
+	unsigned char diag = 0;
+
+	if (move_desc.arc.dir)
+		diag = stepper_arc_next();
+#endif
+
+	/* Software axes step now */
+	for (i = STEP_HW_AXES; i < DDA_AXES; i++) {
+		a = &move_desc.axis[i];
+		if (a->err >= 0) {
+			*axes[i].step_port ^= axes[i].step_mask;
+			a->err -= move_desc.r.steps;
+			a->steps += move_desc.dir[i];
+		}
+		a->err += a->inc;
+	}
+
+	/* Latency statistics, the counters saturate */
+	if (lat < step_jitter.min)
+		step_jitter.min = lat;
+	if (lat > step_jitter.max)
+		step_jitter.max = lat;
+	i = ((lat >> JITTER_BIN_SHIFT) < JITTER_BINS)
+		? (lat >> JITTER_BIN_SHIFT) : JITTER_BINS - 1;
+	if (step_jitter.hist[i] != 0xFFFF)
+		step_jitter.hist[i]++;
+
+	/* The profile counts the steps of the dominant axis, this one is last */
+	if (move_desc.r.step + 1 >= move_desc.r.steps) {
+		stop_t1_a3_c0();
+#if STEP_TIMER_OUTPUTS
+		/* The last steps were done, hold the outputs */
+		for (i = 0; i < STEP_HW_AXES; i++)
+			*axes[i].step_cctl = move_desc.cctl[i] & ~CCIE;
+#endif
+		move_desc.busy = 0;
+		__bic_SR_register_on_exit(IDLE_LPM_BITS);
+	} else {
+#if STEP_TIMER_OUTPUTS
+		/*
+		 * An arc iteration of sqrt(2) grid steps takes that much longer,
+		 * the tool keeps its speed along the arc
+		 */
+		period = ramp_next(&move_desc.r);
+		if (move_desc.arc.dir && stepper_arc_next())
+			period = ARC_DIAG_PERIOD(period);
+		TA1CCR0 = TA1CCR1 = TA1CCR2 = period;
+
+		/* Timer output axes: arm or hold the step of the next event */
+		for (i = 0; i < STEP_HW_AXES; i++) {
+			a = &move_desc.axis[i];
+			if (a->err >= 0) {
+				move_desc.cctl[i] ^= OUT;
+				*axes[i].step_cctl = move_desc.cctl[i]
+					| OUTMOD_4;
+				a->err -= move_desc.r.steps;
+				a->steps += move_desc.dir[i];
+			} else {
+				*axes[i].step_cctl = move_desc.cctl[i];
+			}
+			a->err += a->inc;
+		}
+#else
+		period = ramp_next(&move_desc.r);
+		TA1CCR0 = diag ? ARC_DIAG_PERIOD(period) : period;
+#endif
+	}
+
+	isr_cycles += CLOCK_SINCE(t0);
+}
+
+void __attribute__ ((interrupt(TIMER0_A0_VECTOR))) report_ISR (void)
+{
+	/** Clock at the entry, for #isr_cycles */
+	unsigned int t0 = TA0R;
+
+	/* Next tick, Timer0_A3 keeps running continuously */
+	TA0CCR0 += SMCLK_HZ / 1000 * REPORT_TICK_MS;
+
+	if (--report_left == 0) {
+		report_left = report_ticks;
+		report_due = 1;
+		__bic_SR_register_on_exit(IDLE_LPM_BITS);
+	}
+
+	isr_cycles += CLOCK_SINCE(t0);
+}
+
+void __attribute__ ((interrupt(TIMER0_A1_VECTOR))) clock_ISR (void)
+{
+	/* Reading the vector clears the flag, only the overflow is enabled */
+	if (TA0IV == TA0IV_TAIFG)
+		clock_ovf++;
 }
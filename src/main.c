@@ -10,19 +10,34 @@
 #include "interrupts.h"
 #include "usart.h"
 #include "sys_control.h"
+#include "timers.h"
 
 int main(void)
 {
 	/* Stop watchdog timer */
 	WDTCTL = WDTPW | WDTHOLD;
+	stack_paint();
 
 	initial_setup();
 	config_uart_usart0();
+	start_t0_a3_clock();
 
 	__bis_SR_register(GIE);
 
+	/*
+	 * Parse the received lines while there is room, run the queue, send
+	 * the periodic status and sleep until an interruption when idle
+	 */
 	while(1) {
-		eval_command();
+		read_line();
+		/* Frames skip the G-code parser and its stack frame */
+		if (rx_binary)
+			eval_binary();
+		else
+			eval_command();
+		move();
+		auto_report();
+		sleep_idle();
 	}
 
 	return 0;
@@ -0,0 +1,548 @@
+/**
+ * @file
+ * @brief Implements the motion planner: the queue of pre-parsed motion blocks
+ * and the trapezoidal velocity profile applied to every move.
+ * @author Davi Antônio da Silva Santos
+ */
+
+#include <stddef.h>
+#include "sys_config.h"
+#include "planner.h"
+#include "stepper.h"
+
+/** Motion blocks ring buffer */
+static struct block queue[BLOCK_QUEUE_SIZE];
+/** Index of the oldest block */
+static volatile unsigned char q_tail;
+/** Blocks in the queue */
+static volatile unsigned char q_count;
+/** Arc of the queued arc block, see #plan_arc */
+static struct block_arc q_arc;
+/** One while #q_arc is queued and not started */
+static unsigned char q_arc_used;
+
+/**
+ * @brief Integer square root (floor).
+ * @param[in] n: radicand.
+ * @return floor(sqrt(n)).
+ */
+static unsigned long isqrt(unsigned long n)
+{
+	unsigned long res = 0;
+	unsigned long bit = 1UL << 30;
+
+	while (bit > n)
+		bit >>= 2;
+
+	while (bit) {
+		if (n >= res + bit) {
+			n -= res + bit;
+			res = (res >> 1) + bit;
+		} else {
+			res >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return res;
+}
+
+/**
+ * @brief Divides by shifts and subtractions, giving the quotient and the
+ * remainder in one pass. The MSP430G2553 has no divider: libgcc loops over the
+ * 32 bits, once for the quotient and once more for the remainder, while this
+ * loops over the bits of the quotient only, a few for the ramp increments.
+ * @param[in] num: dividend.
+ * @param[in] den: divisor, not zero.
+ * @param[out] rest: remainder.
+ * @return Quotient.
+ */
+static unsigned long udivmod(unsigned long num, unsigned long den,
+			     unsigned long *rest)
+{
+	/** Quotient bit of the aligned divisor */
+	unsigned long bit = 1;
+	unsigned long q = 0;
+
+	while ((den < num) && !(den & 0x80000000UL)) {
+		den <<= 1;
+		bit <<= 1;
+	}
+
+	while (bit) {
+		if (num >= den) {
+			num -= den;
+			q |= bit;
+		}
+		den >>= 1;
+		bit >>= 1;
+	}
+
+	*rest = num;
+	return q;
+}
+
+unsigned int ramp_init(struct ramp *r, unsigned long steps,
+		       unsigned int min_period, unsigned long accel)
+{
+	/** First step period */
+	unsigned long c0;
+
+	r->steps = steps;
+	r->step = 0;
+	r->rest = 0;
+	r->min_period = min_period;
+	r->decel_start = steps;
+
+	/*
+	 * c0 = 0,676 * SMCLK * sqrt(2/accel), the 0,676 factor compensates the
+	 * error of the first steps of the approximation (AVR446)
+	 */
+	if (accel)
+		c0 = RAMP_C0_FACTOR / isqrt(accel);
+	else
+		c0 = min_period;
+
+	if (c0 > 0xFFFF)
+		c0 = 0xFFFF;
+
+	if (c0 <= min_period) {
+		/* Slow enough to start at full speed, it never decelerates */
+		c0 = min_period;
+		r->decel_start = 0xFFFFFFFFUL;
+	}
+
+	r->period = c0;
+
+	return r->period;
+}
+
+unsigned int ramp_next(struct ramp *r)
+{
+	/** Current period, updated by the profile */
+	unsigned long c = r->period;
+	/** Period increment */
+	unsigned long q;
+	/** Denominator of the period increment */
+	unsigned long den;
+	/** One while the acceleration phase has not finished */
+	char accelerating = (r->decel_start == r->steps);
+
+	r->step++;
+
+	if (accelerating)
+		den = 4*r->step + 1;
+	else if ((r->step >= r->decel_start) && (r->step < r->steps))
+		den = 4*(r->steps - r->step) + 1;
+	else
+		return r->period;
+
+	/* Both ramps share the one call of #udivmod */
+	q = udivmod(2*c + r->rest, den, &r->rest);
+
+	if (accelerating) {
+		c -= q;
+
+		/*
+		 * Stop accelerating at the cruise speed or at half of the
+		 * move, the deceleration mirrors the acceleration
+		 */
+		if ((c <= r->min_period) || (r->step >= r->steps / 2)) {
+			if (c < r->min_period)
+				c = r->min_period;
+			r->decel_start = r->steps - r->step;
+			r->rest = 0;
+		}
+	} else {
+		c += q;
+
+		if (c > 0xFFFF)
+			c = 0xFFFF;
+	}
+
+	r->period = c;
+
+	return r->period;
+}
+
+unsigned long limit_accel(unsigned long accel, unsigned long axis_accel,
+			  unsigned long d_dom, unsigned long d_axis)
+{
+	/** Highest acceleration allowed by the slave axis */
+	unsigned long lim;
+
+	if (d_axis == 0)
+		return accel;
+
+	/*
+	 * Keep the product inside 32 bits, only the ratio matters. The
+	 * ACCEL_* constants must be smaller than 65536.
+	 */
+	while (d_dom > 0xFFFF) {
+		d_dom >>= 1;
+		d_axis >>= 1;
+	}
+
+	if (d_axis == 0)
+		return accel;
+
+	lim = axis_accel * d_dom / d_axis;
+
+	return (lim < accel) ? lim : accel;
+}
+
+unsigned int limit_period(unsigned int period, unsigned int axis_period,
+			  unsigned long d_dom, unsigned long d_axis)
+{
+	/** Fewest dominant axis periods between two slave axis steps */
+	unsigned long k;
+	/** Smallest dominant axis period allowed by the slave axis */
+	unsigned int lim;
+
+	if (d_axis == 0)
+		return period;
+
+	/*
+	 * The Bresenham steps of the slave axis are floor(d_dom/d_axis) or
+	 * ceil(d_dom/d_axis) dominant axis periods apart, the shortest
+	 * interval must be long enough, not only the mean one
+	 */
+	k = d_dom / d_axis;
+	lim = (axis_period + k - 1) / k;
+
+	return (lim > period) ? lim : period;
+}
+
+/**
+ * @brief Computes the dominant axis period of a path at a feedrate, see
+ * #feed_period. Only called from there, its frame does not nest.
+ * @param[in,out] d: distance of each axis in 10 um (or 0,01 degree), indexed
+ * by #axis_id, scaled down.
+ * @param[in] steps: steps of the dominant axis.
+ * @param[in] feed: feedrate in mm/min times #FEED_ONE.
+ * @return The dominant axis period (SMCLK ticks), 0xFFFF at most.
+ */
+static unsigned int path_period(unsigned long *d, unsigned long steps,
+				long feed)
+{
+	/** Path length in 10 um */
+	unsigned long len = 0;
+	/** Scaling of the distances to keep their squares inside 32 bits */
+	unsigned char shift = 0;
+	/** SMCLK ticks per 10 um of path */
+	unsigned long ticks;
+	/** Feedrate in 0,01 mm/min */
+	unsigned long f;
+	/** Dominant axis period */
+	unsigned long period;
+
+	if (!steps)
+		return 0xFFFF;
+
+	/* The feedrate applies to the XYZ path, or to C/E if they move alone */
+	while ((d[AXIS_X] | d[AXIS_Y] | d[AXIS_Z]) > 0x7FFF) {
+		d[AXIS_X] >>= 1;
+		d[AXIS_Y] >>= 1;
+		d[AXIS_Z] >>= 1;
+		shift++;
+	}
+	len = isqrt(d[AXIS_X]*d[AXIS_X] + d[AXIS_Y]*d[AXIS_Y]
+		    + d[AXIS_Z]*d[AXIS_Z]) << shift;
+
+	if (!len)
+		len = (d[AXIS_C] > d[AXIS_E]) ? d[AXIS_C] : d[AXIS_E];
+	if (!len)
+		len = 1;
+
+	f = (feed > 0) ? feed : 1;
+
+	/* period = 60 * SMCLK * len / (feed * steps) */
+	ticks = SMCLK_HZ * 60 / f;
+
+	/* Only the ratio len/steps matters, keep both below 65536 */
+	while ((steps | len) > 0xFFFF) {
+		steps >>= 1;
+		len >>= 1;
+	}
+
+	if (!steps)
+		return 0xFFFF;
+	/* A short path with many C/E steps, the period is the shortest */
+	if (!len)
+		len = 1;
+
+	period = ticks / steps;
+	if (period > 0xFFFF / len)
+		return 0xFFFF;
+	period = period * len + ((ticks % steps) * len) / steps;
+
+	return (period > 0xFFFF) ? 0xFFFF : period;
+}
+
+unsigned int feed_period(const struct block_arc *a, long *delta, long feed)
+{
+	/** Axis counter */
+	unsigned char i;
+	/** Steps of the dominant axis, the arc iterations at least */
+	unsigned long steps = a ? a->n : 0;
+	/** Distance of each axis in 10 um (or 0,01 degree), over the steps */
+	unsigned long *d = (unsigned long *)delta;
+
+	/* The iterations of an arc take the place of the X and Y steps */
+	for (i = a ? AXIS_Z : AXIS_X; i < DDA_AXES; i++) {
+		d[i] = (delta[i] < 0) ? -(unsigned long)delta[i]
+				      : (unsigned long)delta[i];
+		if (d[i] > steps)
+			steps = d[i];
+		d[i] = steps_to_mm(d[i], axes[i].steps_per_unit) / 10000;
+	}
+
+	/*
+	 * Over an octant the arc is pi*sqrt(2)/4 = 1,11072 grid steps per
+	 * iteration, in 10 um. If #step_ISR stretches the sqrt(2) iterations,
+	 * the period is the one of a single grid step: the iterations move
+	 * 4 - 2*sqrt(2) grid steps on average, so 1,11072/1,17157 = 0,948 of
+	 * a grid step along the arc.
+	 */
+	if (a) {
+		d[AXIS_X] = a->n * ((steps == a->n) ? 95 : 111)
+			/ ARC_STEPS_PER_MM;
+		d[AXIS_Y] = 0;
+	}
+
+	return path_period(d, steps, feed);
+}
+
+signed char arc_center(struct block_arc *a, const struct steps_pos *start,
+		       const struct steps_pos *end, long i, long j, long r)
+{
+	/** Largest coordinate on the arc grid */
+	const long lim = (long)ARC_MAX_RADIUS_MM * ARC_STEPS_PER_MM;
+	/** End point relative to the start on the grid */
+	long ux = mm_to_steps(steps_to_mm(end->x - start->x, STEPS_PER_MM_X),
+			      ARC_STEPS_PER_MM);
+	long uy = mm_to_steps(steps_to_mm(end->y - start->y, STEPS_PER_MM_Y),
+			      ARC_STEPS_PER_MM);
+	/** Center relative to the start on the grid */
+	long cx;
+	long cy;
+	/** Half of the chord */
+	long hx;
+	long hy;
+	/** Radius, then the distance from the center to the chord */
+	long h;
+	/** Length of half of the chord */
+	long q;
+
+	if (r == PARAM_NONE) {
+		cx = mm_to_steps(i, ARC_STEPS_PER_MM);
+		cy = mm_to_steps(j, ARC_STEPS_PER_MM);
+	} else {
+		h = mm_to_steps((r < 0) ? -r : r, ARC_STEPS_PER_MM);
+		hx = ux / 2;
+		hy = uy / 2;
+		if (!h || (h > lim) || (hx > h) || (-hx > h) || (hy > h)
+		    || (-hy > h))
+			return -1;
+
+		/* Both are below 2*lim^2, inside 32 bits */
+		q = isqrt((unsigned long)(hx*hx) + (unsigned long)(hy*hy));
+		if (!q || (q > h + 1))
+			return -1;
+		h = (q < h) ? isqrt((unsigned long)(h*h) - (unsigned long)(q*q))
+			    : 0;
+
+		/* (-hy, hx) is on the left of the chord */
+		if ((a->dir > 0) == (r > 0)) {
+			cx = hx - h*hy / q;
+			cy = hy + h*hx / q;
+		} else {
+			cx = hx + h*hy / q;
+			cy = hy - h*hx / q;
+		}
+	}
+
+	if ((cx > lim) || (-cx > lim) || (cy > lim) || (-cy > lim)
+	    || (ux - cx > lim) || (cx - ux > lim) || (uy - cy > lim)
+	    || (cy - uy > lim))
+		return -1;
+
+	a->x0 = -cx;
+	a->y0 = -cy;
+	a->x1 = ux - cx;
+	a->y1 = uy - cy;
+
+	return 0;
+}
+
+/**
+ * @brief Region of a point traced by #arc_next with the same major axis, the
+ * quadrants turned by 45 degrees, numbered counterclockwise.
+ * @param[in] x, y: point relative to the center, not both zero.
+ * @return 0 right, 1 top, 2 left or 3 bottom.
+ */
+static unsigned char arc_region(int x, int y)
+{
+	/** Magnitudes of the coordinates */
+	int ax = (x < 0) ? -x : x;
+	int ay = (y < 0) ? -y : y;
+
+	if (ay > ax)
+		return (y > 0) ? 1 : 3;
+
+	return (x > 0) ? 0 : 2;
+}
+
+signed char arc_plan(struct block_arc *a)
+{
+	/** Squared radius, from the start */
+	unsigned long r2 = (unsigned long)((long)a->x0 * a->x0)
+		+ (unsigned long)((long)a->y0 * a->y0);
+	/** Radius of the start and distance of the end from the center */
+	long r = isqrt(r2);
+	long r1 = isqrt((unsigned long)((long)a->x1 * a->x1)
+			+ (unsigned long)((long)a->y1 * a->y1));
+	/** Major coordinate at the 45 degrees boundaries of the regions */
+	long m = isqrt(r2 / 2);
+	/** Regions of the start and of the end */
+	unsigned char r0 = arc_region(a->x0, a->y0);
+	unsigned char re = arc_region(a->x1, a->y1);
+	/** Major coordinate of the start, and of the end moved to the circle */
+	long p0 = (r0 & 1) ? a->x0 : a->y0;
+	long pe = (re & 1) ? a->x1 : a->y1;
+	/** Side of the end, positive if it is less than half a circle ahead */
+	long c = (long)a->x0 * a->y1 - (long)a->y0 * a->x1;
+	/** Region being crossed */
+	unsigned char i;
+
+	if (!r1 || (r1 > r + ARC_END_TOLERANCE) || (r > r1 + ARC_END_TOLERANCE))
+		return -1;
+	pe = pe * r / r1;
+
+	/* Rounded, they can be a point past the boundaries */
+	if (p0 > m)
+		p0 = m;
+	else if (p0 < -m)
+		p0 = -m;
+	if (pe > m)
+		pe = m;
+	else if (pe < -m)
+		pe = -m;
+
+	/*
+	 * The major axis steps once per iteration and its coordinate goes
+	 * monotonically from -m to m (counterclockwise in the regions 0 and 3,
+	 * clockwise in 1 and 2), so the iterations are the distances along it.
+	 */
+	if ((r0 == re) && (((a->dir > 0) ? c : -c) > 0)) {
+		a->n = (pe > p0) ? pe - p0 : p0 - pe;
+		return 0;
+	}
+
+	/* Up to the end of the first region, then whole ones */
+	i = r0;
+	a->n = (((i == 0) || (i == 3)) == (a->dir > 0)) ? m - p0 : m + p0;
+	for (;;) {
+		i = (i + a->dir) & 3;
+		if (i == re)
+			break;
+		a->n += 2*m;
+	}
+	a->n += (((i == 0) || (i == 3)) == (a->dir > 0)) ? pe + m : m - pe;
+
+	return 0;
+}
+
+long mm_to_steps(long v, unsigned int steps_per_unit)
+{
+	/** Magnitude of the distance */
+	unsigned long u = (v < 0) ? -(unsigned long)v : (unsigned long)v;
+	/** Distance in steps */
+	unsigned long steps;
+
+	/* Integer and fractional parts apart to stay inside 32 bits */
+	steps = (u / FIXED_ONE) * steps_per_unit
+		+ ((u % FIXED_ONE) * steps_per_unit) / FIXED_ONE;
+
+	return (v < 0) ? -(long)steps : (long)steps;
+}
+
+long steps_to_mm(long steps, unsigned int steps_per_unit)
+{
+	/** Magnitude of the distance */
+	unsigned long u = (steps < 0) ? -(unsigned long)steps
+				      : (unsigned long)steps;
+	/** Distance in mm times #FIXED_ONE */
+	unsigned long v;
+
+	v = (u / steps_per_unit) * FIXED_ONE
+		+ ((u % steps_per_unit) * FIXED_ONE) / steps_per_unit;
+
+	return (steps < 0) ? -(long)v : (long)v;
+}
+
+struct block *plan_free(void)
+{
+	if (q_count >= BLOCK_QUEUE_SIZE)
+		return NULL;
+
+	return &queue[(q_tail + q_count) & (BLOCK_QUEUE_SIZE - 1)];
+}
+
+struct block_arc *plan_arc_free(void)
+{
+	return q_arc_used ? NULL : &q_arc;
+}
+
+char plan_push(char arc)
+{
+	if ((q_count >= BLOCK_QUEUE_SIZE) || (arc && q_arc_used))
+		return 0;
+
+	if (arc)
+		q_arc_used = 1;
+	queue[(q_tail + q_count) & (BLOCK_QUEUE_SIZE - 1)].arc = arc;
+	q_count++;
+
+	return 1;
+}
+
+struct block *plan_peek(void)
+{
+	if (!q_count)
+		return NULL;
+
+	return &queue[q_tail];
+}
+
+struct block *plan_last(void)
+{
+	if (!q_count)
+		return NULL;
+
+	return &queue[(q_tail + q_count - 1) & (BLOCK_QUEUE_SIZE - 1)];
+}
+
+void plan_pop(void)
+{
+	if (!q_count)
+		return;
+
+	q_tail = (q_tail + 1) & (BLOCK_QUEUE_SIZE - 1);
+	q_count--;
+}
+
+const struct block_arc *plan_arc(void)
+{
+	return q_arc_used ? &q_arc : NULL;
+}
+
+void plan_arc_pop(void)
+{
+	q_arc_used = 0;
+}
+
+unsigned char plan_count(void)
+{
+	return q_count;
+}
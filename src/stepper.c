@@ -0,0 +1,452 @@
+/**
+ * @file
+ * @brief Implements the interrupt-driven step generator. The step loop itself
+ * is #step_ISR.
+ * @author Davi Antônio da Silva Santos
+ */
+
+#include <msp430.h>
+#include "sys_config.h"
+#include "timers.h"
+#include "planner.h"
+#include "stepper.h"
+
+const struct axis_desc axes[DDA_AXES] = {
+	/* X is positive to the left */
+	{'X', &P2OUT, STEPS_X, &P1OUT, DIR_X, DIR_X, STEPS_PER_MM_X,
+		MIN_PULSE_PERIOD_XDIR, ACCEL_X, &TA1CCTL1},
+	/* Y is positive backwards */
+	{'Y', &P2OUT, STEPS_Y, &P1OUT, DIR_Y, 0, STEPS_PER_MM_Y,
+		MIN_PULSE_PERIOD_YDIR, ACCEL_Y, &TA1CCTL0},
+	/* Z is positive downwards */
+	{'Z', &P2OUT, STEPS_Z, &P2OUT, DIR_Z, DIR_Z, STEPS_PER_MM_Z,
+		MIN_PULSE_PERIOD_ZDIR, ACCEL_Z, &TA1CCTL2},
+	/* C is positive clockwise, no timer output on P1.6 */
+	{'C', &P1OUT, STEPS_RZ, &P2OUT, DIR_RZ, DIR_RZ, STEPS_PER_DEG_RZ,
+		MIN_PULSE_PERIOD_ROT, ACCEL_ROT, 0},
+	/* E is positive downwards, no timer output on P1.7 */
+	{'E', &P1OUT, STEPS_S, &P2OUT, DIR_S, 0, STEPS_PER_MM_S,
+		MIN_PULSE_PERIOD_SOLDER, ACCEL_SOLDER, 0}
+};
+
+struct move_desc move_desc;
+struct step_jitter step_jitter = {0xFFFF, 0, {0}};
+
+#if STEP_TIMER_OUTPUTS
+/**
+ * @brief Holds a Timer1_A3 step output at its current level, cancelling the
+ * step armed for the next event, if any.
+ * @param[in] axis: axis index, below #STEP_HW_AXES.
+ * @return Void.
+ */
+static void output_hold(unsigned char axis)
+{
+	/** Axis being held */
+	struct dda_axis *a = &move_desc.axis[axis];
+	/** Capture/compare control, the flag is cleared when a step is armed */
+	unsigned int cctl = *axes[axis].step_cctl;
+
+	/*
+	 * No compare since the toggle was armed: it did not happen, the level
+	 * and the steps are the previous ones
+	 */
+	if ((cctl & (OUTMOD_7 | CCIFG)) == OUTMOD_4) {
+		move_desc.cctl[axis] ^= OUT;
+		a->steps -= move_desc.dir[axis];
+	}
+	/* A pending CCR0 event is still handled by #step_ISR */
+	*axes[axis].step_cctl = move_desc.cctl[axis] | (cctl & CCIFG);
+}
+#endif
+
+/**
+ * @brief Sets up a move whose directions are already set, see #stepper_move.
+ * The steps of each axis (the arc iterations for X and Y if #move_desc.arc is
+ * set) are taken from #dda_axis.inc, where #set_dir left them.
+ * @param[in] period: requested cruise period of the dominant axis.
+ * @return The period of the first step, zero if there is nothing to move.
+ */
+static unsigned int move_init(unsigned int period)
+{
+	/** Axis counter */
+	unsigned char i;
+	/** Dominant axis */
+	unsigned char dom = 0;
+	/** Steps of the dominant axis */
+	unsigned long d_dom;
+	/** Axis being set up */
+	struct dda_axis *a;
+	/** Dominant axis acceleration in steps/s^2 */
+	unsigned long accel;
+
+	for (i = 0; i < DDA_AXES; i++)
+		if (move_desc.axis[i].inc > move_desc.axis[dom].inc)
+			dom = i;
+
+	d_dom = move_desc.axis[dom].inc;
+	if (!d_dom)
+		return 0;
+
+	/*
+	 * Neither the speed nor the acceleration of any axis may exceed its
+	 * own limits
+	 */
+	accel = axes[dom].accel;
+	for (i = 0; i < DDA_AXES; i++) {
+		a = &move_desc.axis[i];
+		period = limit_period(period, axes[i].min_period, d_dom, a->inc);
+		accel = limit_accel(accel, axes[i].accel, d_dom, a->inc);
+
+		/*
+		 * Half the initial error terms of the original Bresenham loops,
+		 * rounded down: the axes step at the same events
+		 */
+		a->err = a->inc - (long)((d_dom + 1) / 2);
+		a->steps = 0;
+	}
+
+	/* The arc iterations take the Bresenham term of X */
+	move_desc.arc_err = move_desc.axis[AXIS_X].err;
+	move_desc.busy = 1;
+	return ramp_init(&move_desc.r, d_dom, period, accel);
+}
+
+/**
+ * @brief Starts a move set up by #move_init. With #STEP_TIMER_OUTPUTS the
+ * first iteration of an arc must have been taken already
+ * (#stepper_arc_next).
+ * @param[in] c0: period of the first step.
+ * @return Void.
+ */
+static void move_arm(unsigned int c0)
+{
+#if STEP_TIMER_OUTPUTS
+	/** Axis counter */
+	unsigned char i;
+	/** Timer output axis being armed */
+	struct dda_axis *h;
+	/** Its TA1CCTLn value, see #move_desc.cctl */
+	unsigned int *cctl;
+
+	/* Timer output axes: arm or hold the first event, see #step_ISR */
+	for (i = 0; i < STEP_HW_AXES; i++) {
+		h = &move_desc.axis[i];
+		cctl = &move_desc.cctl[i];
+		*cctl = (*cctl & OUT)
+			| ((axes[i].step_cctl == &TA1CCTL0) ? CCIE : 0);
+		if (h->err >= 0) {
+			*cctl ^= OUT;
+			*axes[i].step_cctl = *cctl | OUTMOD_4;
+			h->err -= move_desc.r.steps;
+			h->steps += move_desc.dir[i];
+		} else {
+			*axes[i].step_cctl = *cctl;
+		}
+		h->err += h->inc;
+	}
+#endif
+
+	start_t1_a3_c0_it(c0);
+}
+
+/**
+ * @brief Sets the direction pin of an axis for a move and leaves its steps in
+ * #dda_axis.inc for #move_init.
+ * @param[in] i: axis index (#axis_id).
+ * @param[in] delta: relative move in steps.
+ * @return Void.
+ */
+static void set_dir(unsigned char i, long delta)
+{
+	/** Axis being set */
+	const struct axis_desc *a = &axes[i];
+
+	if (delta > 0) {
+		*a->dir_port = (*a->dir_port & ~a->dir_mask) | a->dir_pos;
+		move_desc.dir[i] = 1;
+		move_desc.axis[i].inc = delta;
+		return;
+	}
+
+	*a->dir_port = (*a->dir_port & ~a->dir_mask)
+		| (a->dir_pos ^ a->dir_mask);
+	move_desc.dir[i] = -1;
+	move_desc.axis[i].inc = -delta;
+}
+
+void stepper_move(const long *delta, unsigned int period)
+{
+	/** Axis counter */
+	unsigned char i;
+
+	/** Period of the first step */
+	unsigned int c0;
+
+	for (i = 0; i < DDA_AXES; i++)
+		set_dir(i, delta[i]);
+
+	move_desc.arc.dir = 0;
+	c0 = move_init(period);
+	if (c0)
+		move_arm(c0);
+}
+
+void stepper_arc(const struct block_arc *arc, const long *delta,
+		 unsigned int period)
+{
+	/** Axis counter */
+	unsigned char i;
+	/** Period of the first step */
+	unsigned int c0;
+
+	/* X and Y step once per iteration at most */
+	move_desc.axis[AXIS_X].inc = arc->n;
+	move_desc.axis[AXIS_Y].inc = arc->n;
+	arc_init(&move_desc.arc, arc);
+	move_desc.arc.stretch = ARC_DIAG;
+	for (i = AXIS_Z; i < DDA_AXES; i++) {
+		set_dir(i, delta[i]);
+		if ((unsigned long)move_desc.axis[i].inc > arc->n)
+			move_desc.arc.stretch = 0;
+	}
+
+	c0 = move_init(period);
+	if (!c0)
+		return;
+#if STEP_TIMER_OUTPUTS
+	stepper_arc_next();
+#endif
+	move_arm(c0);
+}
+
+void arc_init(struct arc *a, const struct block_arc *b)
+{
+	a->x = b->x0;
+	a->y = b->y0;
+	a->e = 0;
+	a->dir = b->dir;
+
+	/* c = dir*(x*y1 - y*x1), then updated by additions only */
+	a->cx = (b->dir > 0) ? b->y1 : -b->y1;
+	a->cy = (b->dir > 0) ? -b->x1 : b->x1;
+	a->c = (long)b->x0 * a->cx + (long)b->y0 * a->cy;
+
+	a->ex = 0;
+	a->ey = 0;
+}
+
+/**
+ * @brief Advances the arc generator by one iteration: one grid step along the
+ * major axis of the tangent and, if it keeps the point closer to the circle,
+ * one along the other axis (midpoint circle algorithm, integer additions
+ * only). The grid steps are scaled to X and Y steps. Only called by
+ * #stepper_arc_next, which takes it in its own frame within #step_ISR.
+ * @param[in,out] a: generator state set by #arc_init.
+ * @return The X and Y steps to be done, ARC_* bits.
+ */
+static unsigned char arc_next(struct arc *a)
+{
+	/** Grid steps of X and Y, -1, 0 or 1 */
+	signed char sx;
+	signed char sy;
+	/** Distance to the circle after the major step, and after both */
+	long e1;
+	long e2;
+	/** One while the end is ahead */
+	char ahead = (a->c > 0);
+	/** Steps to be done */
+	unsigned char bits = 0;
+	/** Magnitudes of the point coordinates */
+	int ax = (a->x < 0) ? -a->x : a->x;
+	int ay = (a->y < 0) ? -a->y : a->y;
+
+	/*
+	 * The tangent is dir*(-y, x). Its major axis always steps, the minor
+	 * one only steps if that keeps the point closer to the circle. On the
+	 * axes the minor step goes towards the center.
+	 */
+	if (ay > ax) {
+		sx = ((a->y > 0) == (a->dir > 0)) ? -1 : 1;
+		if (a->x)
+			sy = ((a->x > 0) == (a->dir > 0)) ? 1 : -1;
+		else
+			sy = (a->y > 0) ? -1 : 1;
+
+		/* (x + sx)^2 - x^2 = 2*sx*x + 1 */
+		e1 = a->e + ((sx > 0) ? 2L*a->x : -2L*a->x) + 1;
+		e2 = e1 + ((sy > 0) ? 2L*a->y : -2L*a->y) + 1;
+		if (((e2 < 0) ? -e2 : e2) < ((e1 < 0) ? -e1 : e1)) {
+			a->e = e2;
+		} else {
+			a->e = e1;
+			sy = 0;
+		}
+	} else {
+		sy = ((a->x > 0) == (a->dir > 0)) ? 1 : -1;
+		if (a->y)
+			sx = ((a->y > 0) == (a->dir > 0)) ? -1 : 1;
+		else
+			sx = (a->x > 0) ? -1 : 1;
+
+		e1 = a->e + ((sy > 0) ? 2L*a->y : -2L*a->y) + 1;
+		e2 = e1 + ((sx > 0) ? 2L*a->x : -2L*a->x) + 1;
+		if (((e2 < 0) ? -e2 : e2) < ((e1 < 0) ? -e1 : e1)) {
+			a->e = e2;
+		} else {
+			a->e = e1;
+			sx = 0;
+		}
+	}
+
+	/*
+	 * The X and Y steps are the grid steps scaled by their steps per mm,
+	 * rounded: ex = X steps * ARC_STEPS_PER_MM - grid x * STEPS_PER_MM_X
+	 */
+	if (sx) {
+		a->x += sx;
+		a->c += (sx > 0) ? a->cx : -a->cx;
+		a->ex += (sx > 0) ? -STEPS_PER_MM_X : STEPS_PER_MM_X;
+		if (a->ex < -(ARC_STEPS_PER_MM / 2)) {
+			a->ex += ARC_STEPS_PER_MM;
+			bits |= ARC_STEP_X;
+		} else if (a->ex > ARC_STEPS_PER_MM / 2) {
+			a->ex -= ARC_STEPS_PER_MM;
+			bits |= ARC_STEP_X | ARC_NEG_X;
+		}
+	}
+	if (sy) {
+		a->y += sy;
+		a->c += (sy > 0) ? a->cy : -a->cy;
+		a->ey += (sy > 0) ? -STEPS_PER_MM_Y : STEPS_PER_MM_Y;
+		if (a->ey < -(ARC_STEPS_PER_MM / 2)) {
+			a->ey += ARC_STEPS_PER_MM;
+			bits |= ARC_STEP_Y;
+		} else if (a->ey > ARC_STEPS_PER_MM / 2) {
+			a->ey -= ARC_STEPS_PER_MM;
+			bits |= ARC_STEP_Y | ARC_NEG_Y;
+		}
+	}
+
+	/* The cross product only turns from positive to not at the end */
+	if (ahead && (a->c <= 0))
+		bits |= ARC_END;
+	if (sx && sy)
+		bits |= ARC_DIAG;
+
+	return bits;
+}
+
+unsigned char stepper_arc_next(void)
+{
+	/** Steps of this iteration */
+	unsigned char bits = 0;
+	/** X and Y counter */
+	unsigned char i;
+	/** Axis being set */
+	const struct axis_desc *a;
+	/** Non-zero if the period of this event is stretched */
+	unsigned char diag;
+
+	if (move_desc.arc_err >= 0) {
+		bits = arc_next(&move_desc.arc);
+		move_desc.arc_err -= move_desc.r.steps;
+
+		/*
+		 * #arc_plan counts the iterations within a few, X and Y stop
+		 * at the end and the events left only move Z, C and E
+		 */
+		if (bits & ARC_END)
+			move_desc.axis[AXIS_X].inc = 0;
+	}
+	move_desc.arc_err += move_desc.axis[AXIS_X].inc;
+	diag = bits & move_desc.arc.stretch;
+
+	/* X bits first, then Y bits, see ARC_STEP_X */
+	for (i = AXIS_X; i <= AXIS_Y; i++, bits >>= 2) {
+		a = &axes[i];
+		if (bits & ARC_STEP_X) {
+			*a->dir_port = (*a->dir_port & ~a->dir_mask)
+				| ((bits & ARC_NEG_X)
+				   ? (a->dir_pos ^ a->dir_mask) : a->dir_pos);
+			move_desc.dir[i] = (bits & ARC_NEG_X) ? -1 : 1;
+			move_desc.axis[i].err = 0;
+		} else {
+			move_desc.axis[i].err = -1;
+		}
+	}
+
+	return diag;
+}
+
+char stepper_busy(void)
+{
+	return move_desc.busy;
+}
+
+void stepper_wait(void)
+{
+	/** Interruptions state to be restored */
+	unsigned int gie = __get_SR_register() & GIE;
+
+	__disable_interrupt();
+	while (move_desc.busy)
+		cpu_sleep();
+	__bis_SR_register(gie);
+}
+
+void jitter_take(struct step_jitter *j)
+{
+	/** Interruptions state to be restored */
+	unsigned int gie = __get_SR_register() & GIE;
+	/** Bin counter */
+	unsigned char i;
+
+	__disable_interrupt();
+	*j = step_jitter;
+	step_jitter.min = 0xFFFF;
+	step_jitter.max = 0;
+	for (i = 0; i < JITTER_BINS; i++)
+		step_jitter.hist[i] = 0;
+	__bis_SR_register(gie);
+}
+
+void stepper_abort(void)
+{
+#if STEP_TIMER_OUTPUTS
+	/** Axis counter */
+	unsigned char i;
+#endif
+
+	stop_t1_a3_c0();
+#if STEP_TIMER_OUTPUTS
+	for (i = 0; i < STEP_HW_AXES; i++)
+		output_hold(i);
+	/* Holding TA1.0 set its interruption enable again */
+	TA1CCTL0 &= ~CCIE;
+#endif
+	move_desc.busy = 0;
+}
+
+void stepper_steps(long *steps)
+{
+	/** Interruptions state to be restored */
+	unsigned int gie = __get_SR_register() & GIE;
+	/** Axis counter */
+	unsigned char i;
+
+	__disable_interrupt();
+	for (i = 0; i < DDA_AXES; i++)
+		steps[i] = move_desc.axis[i].steps;
+	__bis_SR_register(gie);
+}
+
+void stepper_halt(unsigned char axis)
+{
+	/* The error term never gets back to zero, so the axis never steps */
+	move_desc.axis[axis].inc = 0;
+	move_desc.axis[axis].err = -0x40000000L;
+#if STEP_TIMER_OUTPUTS
+	if (axis < STEP_HW_AXES)
+		output_hold(axis);
+#endif
+}
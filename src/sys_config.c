@@ -6,12 +6,21 @@
  */
 
 #include <msp430.h>
+#include <stdint.h>
 #include <string.h>
 #include "sys_config.h"
+#include "usart.h"
 #include "sys_control.h"
 
 volatile char execute_routine = 0;
 
+/*
+ * Linker script symbols: the end of the variables, where the free RAM starts,
+ * and the top of the RAM, where the stack starts
+ */
+extern char end[];
+extern char __stack[];
+
 void initial_setup(void)
 {
 	/*
@@ -72,6 +81,14 @@ void initial_setup(void)
 	P1OUT &= ~(STEPS_S | STEPS_RZ);
 	P2DIR |= (STEPS_Y | STEPS_X | STEPS_Z);
 	P2OUT &= ~(STEPS_Y | STEPS_X | STEPS_Z);
+#if STEP_TIMER_OUTPUTS
+	/* X, Y and Z steps are the Timer1_A3 outputs, low until the first move */
+	TA1CCTL0 = OUTMOD_0;
+	TA1CCTL1 = OUTMOD_0;
+	TA1CCTL2 = OUTMOD_0;
+	P2SEL |= (STEPS_Y | STEPS_X | STEPS_Z);
+	P2SEL2 &= ~(STEPS_Y | STEPS_X | STEPS_Z);
+#endif
 	
 	P1DIR |= (DIR_X | DIR_Y);
 	P1OUT &= ~(DIR_X | DIR_Y);
@@ -83,11 +100,36 @@ void initial_setup(void)
 	P2SEL2 &= ~VACUUM;
 	P2OUT &= ~VACUUM;
 	
-	/* Reset the TX and RX buffers */
+	/* Reset the RX buffer */
 	memset(rx_data_raw, 0, RX_STR_SIZE);
-	memset(tx_data_raw, 0, TX_STR_SIZE);
 	
 	/* Initialise the control vars */
-	memset(&req_status, 0, sizeof(struct status));
 	memset(&curr_status, 0, sizeof(struct status));
 }
+
+void stack_paint(void)
+{
+	/** Its address is the stack pointer, about */
+	char sp;
+	/** End of the painting, below this frame */
+	char *top = (char *)((uintptr_t)&sp - STACK_PAINT_GUARD);
+	/** Byte being painted */
+	char *p;
+	
+	/* Below the top of the RAM too, the stack may be elsewhere (host) */
+	for (p = end; (p < top) && (p < __stack); p++)
+		*p = STACK_PAINT;
+}
+
+unsigned int stack_free(unsigned int *used)
+{
+	/** Lowest byte reached by the stack, once found */
+	const char *p = end;
+	
+	/* The stack grows down from the top of the RAM */
+	while ((p < __stack) && (*p == STACK_PAINT))
+		p++;
+	
+	*used = __stack - p;
+	return p - end;
+}
@@ -8,121 +8,538 @@
 
 #include <msp430.h>
 #include <string.h>
-#include <stdlib.h>
-#include <float.h>
 #include "sys_config.h"
 #include "usart.h"
 #include "sys_control.h"
 #include "timers.h"
+#include "planner.h"
+#include "stepper.h"
 
-/** Maximum Z axis position in mm while in solder routine mm*/
-const float max_z_solder = 53.2f;
+/** Maximum Z axis position in mm while in solder routine 53.2 mm */
+const long max_z_solder = 53200000L;
 /** Maximum Z axis position in mm while in regular routine 64.41 mm*/
-const float max_z_component = 64.41f;
+const long max_z_component = 64410000L;
 /** Maximum X axis position in mm */
-const float max_x = 298.0f;
+const long max_x = 298L*FIXED_ONE;
 /** Maximum Y axis position in mm */
-const float max_y = 370.0f;
+const long max_y = 370L*FIXED_ONE;
+/**
+ * One after the move of the oldest block has been started, two after the line
+ * from the end of its arc to its target has been
+ */
+static char move_phase;
+/** G1 feedrate in mm/min times #FEED_ONE, modal (F word) */
+static long feedrate = DEFAULT_FEEDRATE;
+unsigned int report_ticks;
+volatile unsigned int report_left;
+volatile char report_due;
+volatile unsigned char home_axes;
+volatile unsigned char end_hit;
+struct status curr_status;
+/** One while the line waits for the queue, until a block is popped */
+static char line_waiting;
+/**
+ * One to acknowledge each line with "ok" once buffered (M14), zero to send
+ * "done" once performed (M15)
+ */
+static char ack_ok;
 
-void calibrate()
+/**
+ * @brief Sends "done" at the end of a command, unless the lines are
+ * acknowledged with "ok" (#ack_ok).
+ * @return Void.
+ */
+static void send_done(void)
 {
-	/*
-	 * P1IFG is reconfigured to avoid errors, but it will be reset
-	 * automatically if it is set inside the interruption handler
-	 */
-	P1IFG = 0;
+	if (!ack_ok)
+		send_string("done\n");
+}
+
+/**
+ * @brief Acknowledges the line just evaluated with "ok P<n> B<n>": the free
+ * blocks in the planner queue and the free bytes in the receiver ring.
+ * @return Void.
+ */
+static void send_ok(void)
+{
+	send_string("ok P");
+	print_int(BLOCK_QUEUE_SIZE - plan_count());
+	send_string(" B");
+	print_int(RX_RING_SIZE - 1
+		  - ((rx_head - rx_tail) & (RX_RING_SIZE - 1)));
+	send_char('\n');
+}
+
+/**
+ * @brief Distance within which an axis must find its endstop, see #home_move.
+ * @param[in] i: X, Y or Z (#axis_id).
+ * @param[in] pass: zero for the fast pass, one for the slow pass.
+ * @return Steps of the axis towards its endstop, negative.
+ */
+static long home_steps(unsigned char i, unsigned char pass)
+{
+	/** Distance in whole mm */
+	unsigned int mm;
 	
-	curr_status.calibrated = 0;
-	req_status.calibrated = 1;
-	req_status.error = 0;
-	curr_status.end_triggd = 0;
+	if (pass)
+		mm = 2 * HOME_BACKOFF_MM;
+	else
+		mm = ((i == AXIS_X) ? max_x : (i == AXIS_Y) ? max_y
+		      : max_z_component) / FIXED_ONE + HOME_MARGIN_MM;
+	
+	return -(long)mm * axes[i].steps_per_unit;
+}
+
+/**
+ * @brief Moves X, Y and Z together, each one at its own rate, and waits for
+ * the end of the move.
+ *
+ * Each axis would take its steps at a fraction of its maximum rate; the axes
+ * which would end earlier get more steps, so all of them keep that rate for
+ * the whole move (the steps of each axis are proportional to its rate). Each
+ * axis is halted once it has done its own steps (#home_steps), so none moves
+ * further than asked: the CPU stays awake and polls the step counters, a few
+ * hundred cycles per check, and the move ends when no axis seeking its
+ * endstop (#home_axes) can move.
+ * The fast pass seeks the endstops within the length of each axis plus
+ * #HOME_MARGIN_MM, the slow pass (1/#HOME_SLOW_DIV of the rates) within twice
+ * #HOME_BACKOFF_MM.
+ * @param[in] pass: zero for the fast pass, one for the slow pass.
+ * @return Void.
+ */
+static void home_move(unsigned char pass)
+{
+	/** Move in steps, then the steps done */
+	long delta[DDA_AXES] = {0};
+	/** Maximum rates divider */
+	unsigned int div = pass ? HOME_SLOW_DIV : 1;
+	/** Duration of the longest axis in SMCLK cycles */
+	unsigned long t = 0;
+	/** Duration or steps of an axis */
+	unsigned long n;
+	/** Steps of the dominant axis */
+	unsigned long d_dom = 0;
+	/** Axis counter */
+	unsigned char i;
+	/** Dominant axis */
+	unsigned char dom = AXIS_X;
+	/** Axes which have not done their own steps yet */
+	unsigned char left = (1 << AXIS_X) | (1 << AXIS_Y) | (1 << AXIS_Z);
 	
-	/* Move X axis to X- */
-	RESET_DIR_X;
-	send_string("Goto X-\n");
+	for (i = AXIS_X; i <= AXIS_Z; i++) {
+		n = -(unsigned long)home_steps(i, pass) * axes[i].min_period
+			* div;
+		if (n > t)
+			t = n;
+	}
 	
-	while((!curr_status.end_triggd)) {
-		TOGGLE_STEPS_X;
-		__delay_cycles(MIN_PULSE_CALIB_XYZ);
+	for (i = AXIS_X; i <= AXIS_Z; i++) {
+		n = t / ((unsigned long)axes[i].min_period * div);
+		delta[i] = -(long)n;
+		if (n > d_dom) {
+			d_dom = n;
+			dom = i;
+		}
 	}
+	
+	/*
+	 * No axis moves before the move is started: an endstop handler would
+	 * only nest in its setup, it is taken right after
+	 */
 	P1IE &= ~(SWX | SWY);
-	bresenham_3d(0, 0, 0, 5, 0, 0, MIN_PULSE_PERIOD_XDIR);
-	curr_status.end_triggd = 0;
-	send_string("X- OK\n");
-	P1IE |= (SWX | SWY);
+	P2IE &= ~SWZ;
+	stepper_move(delta, axes[dom].min_period * div);
+	P1IE |= SWX | SWY;
+	P2IE |= SWZ;
+	
+	/* #home_steps is computed again at each check, not kept */
+	while (stepper_busy() && (left & home_axes)) {
+		stepper_steps(delta);
+		for (i = AXIS_X; i <= AXIS_Z; i++) {
+			if (!(left & (1 << i))
+			    || (delta[i] > home_steps(i, pass)))
+				continue;
+			__disable_interrupt();
+			stepper_halt(i);
+			__enable_interrupt();
+			left &= ~(1 << i);
+		}
+	}
 	
-	/* Move Y axis to zero */
-	SET_DIR_Y;
-	send_string("Goto Y-\n");
+	/* The axes left are halted, the move would only take time */
+	__disable_interrupt();
+	stepper_abort();
+	__enable_interrupt();
+}
+
+/**
+ * @brief Moves X, Y and Z away from their endstops and waits for the end of
+ * the move.
+ * @param[in] mm: distance of each axis in mm.
+ * @return Void.
+ */
+static void home_backoff(unsigned int mm)
+{
+	/** Move in steps */
+	long steps[DDA_AXES] = {0};
+	/** Axis counter */
+	unsigned char i;
 	
-	while((!curr_status.end_triggd)) {
-		TOGGLE_STEPS_Y;
-		__delay_cycles(MIN_PULSE_CALIB_XYZ);
+	for (i = AXIS_X; i <= AXIS_Z; i++)
+		steps[i] = (long)mm * axes[i].steps_per_unit;
+	stepper_move(steps, 0);
+	stepper_wait();
+}
+
+/**
+ * @brief Enables or disables the X, Y and Z endstops interruptions. The
+ * pending flags are cleared before enabling them.
+ * @param[in] on: 1 to enable, 0 to disable.
+ * @return Void.
+ */
+static void endstops_enable(char on)
+{
+	if (on) {
+		P1IFG &= ~(SWX | SWY);
+		P2IFG &= ~SWZ;
+		P1IE |= SWX | SWY;
+		P2IE |= SWZ;
+	} else {
+		P1IE &= ~(SWX | SWY);
+		P2IE &= ~SWZ;
 	}
-	P1IE &= ~(SWX | SWY);
-	bresenham_3d(0, 0, 0, 0, 5, 0, MIN_PULSE_PERIOD_YDIR);
-	curr_status.end_triggd = 0;
-	send_string("Y- OK\n");
-	P1IE |= (SWX | SWY);
-	
-	/* Move Z axis to zero */
-	RESET_DIR_Z;
-	send_string("Goto Z-\n");
-	while((!curr_status.end_triggd)) {
-		TOGGLE_STEPS_Z;
-		__delay_cycles(MIN_PULSE_CALIB_XYZ);
+}
+
+/**
+ * @brief Sends "X- OK" or "X- FAIL" for each of the X, Y and Z axes.
+ * @param[in] failed: axes whose endstop was not found, bit n for #axis_id n.
+ * @return Void.
+ */
+static void home_report(unsigned char failed)
+{
+	/** Axis counter */
+	unsigned char i;
+	
+	for (i = AXIS_X; i <= AXIS_Z; i++) {
+		send_char(axes[i].letter);
+		if (failed & (1 << i))
+			send_string("- FAIL\n");
+		else
+			send_string("- OK\n");
 	}
-	P2IE &= ~SWZ;
-	bresenham_3d(0, 0, 0, 0, 0, 5, MIN_PULSE_PERIOD_ZDIR);
+}
+
+void calibrate()
+{
+	/** Pass counter: fast approach, then slow approach */
+	unsigned char pass;
+	
+	curr_status.calibrated = 0;
 	curr_status.end_triggd = 0;
-	send_string("Z- OK\n");
-	P2IE |= SWZ;
+	
+	send_string("Goto XYZ-\n");
+	
+	/*
+	 * All the axes seek their endstops at the same time and each one is
+	 * stopped by its own endstop (see #home_axes), then they back off.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		endstops_enable(1);
+		home_axes = (1 << AXIS_X) | (1 << AXIS_Y) | (1 << AXIS_Z);
+		home_move(pass);
+		
+		if (home_axes) {
+			home_report(home_axes);
+			home_axes = 0;
+			curr_status.error = 1;
+			send_done();
+			return;
+		}
+		
+		/* Leave the endstops with their interruptions disabled */
+		endstops_enable(0);
+		home_backoff(pass ? HOME_OFFSET_MM : HOME_BACKOFF_MM);
+	}
+	endstops_enable(1);
+	home_report(0);
 
 	curr_status.calibrated = 1;
-	curr_status.x = 0;
-	curr_status.y = 0;
-	curr_status.z = 0;
-	req_status.x = 0;
-	req_status.y = 0;
-	req_status.z = 0;
+	curr_status.pos.x = 0;
+	curr_status.pos.y = 0;
+	curr_status.pos.z = 0;
 	curr_status.end_triggd = 0;
 	curr_status.error = 0;
 
-	send_string("done\n");
+	send_done();
 }
 
-void move()
+const struct steps_pos *queued_pos(void)
 {
-	unsigned int period;
-	
-	if (!curr_status.error) {
-		/* Move as fast as the slowest motor */
-		if (curr_status.y != req_status.y) {
-			/* Slowest motor */
-			period = MIN_PULSE_PERIOD_YDIR;
-		} else if (curr_status.x != req_status.x) {
-			/* Second slowest motor */
-			period = MIN_PULSE_PERIOD_XDIR;
-		} else {
-			/* Fastest */
-			period = MIN_PULSE_PERIOD_ZDIR;
+	/** Newest block in the queue */
+	const struct block *last = plan_last();
+	
+	/* A block stays queued until #move has performed it */
+	return last ? &last->target : &curr_status.pos;
+}
+
+void plan_move(struct block *b, long feed, char arc)
+{
+	/** Relative move of each axis in steps */
+	long delta[DDA_AXES];
+	/** Start of the move */
+	const struct steps_pos *start = queued_pos();
+	
+	if (curr_status.error) {
+		send_string("RECAL\n");
+		send_done();
+		return;
+	}
+	
+	delta[AXIS_X] = b->target.x - start->x;
+	delta[AXIS_Y] = b->target.y - start->y;
+	delta[AXIS_Z] = b->target.z - start->z;
+	delta[AXIS_C] = b->rz;
+	delta[AXIS_E] = b->target.solder - start->solder;
+	
+	if (arc) {
+		b->period = feed_period(plan_arc_free(), delta, feed);
+	} else {
+		/*
+		 * Rapid moves run as fast as the axes allow, #stepper_move
+		 * limits the period of each axis
+		 */
+		b->period = feed ? feed_period(NULL, delta, feed) : 0;
+	}
+	
+	/* eval_command only calls this function if there is room */
+	plan_push(arc);
+}
+
+/**
+ * @brief Reports the endstops triggered out of #calibrate (#end_hit) and
+ * updates the position: the steps done by the aborted move, if any, are added
+ * to the start of its block.
+ * @return Void.
+ */
+static void end_report(void)
+{
+	/** Steps done by each axis */
+	long steps[DDA_AXES];
+	/** Triggered endstops */
+	unsigned char hit;
+	/** Axis counter */
+	unsigned char i;
+	
+	__disable_interrupt();
+	hit = end_hit;
+	end_hit = 0;
+	__enable_interrupt();
+	
+	/* The counters of a move which ended are its whole steps */
+	if (move_phase) {
+		stepper_steps(steps);
+		curr_status.pos.x += steps[AXIS_X];
+		curr_status.pos.y += steps[AXIS_Y];
+		curr_status.pos.z += steps[AXIS_Z];
+		curr_status.pos.solder += steps[AXIS_E];
+	}
+	
+	send_string("E H");
+	for (i = AXIS_X; i <= AXIS_Z; i++) {
+		if (hit & (1 << i)) {
+			send_char(' ');
+			send_char(axes[i].letter);
 		}
+	}
+	send_char('\n');
+}
 
-		bresenham_3d(curr_status.x, curr_status.y, curr_status.z,
-				req_status.x, req_status.y, req_status.z,
-				period);
-				
-		/* Initial position must always be treated as zero */
-		move_rz(0, req_status.rz, MIN_PULSE_PERIOD_ROT);
+void move()
+{
+	/** Oldest block in the queue */
+	struct block *b = plan_peek();
+	/** Relative move of each axis in steps */
+	long delta[DDA_AXES];
+	
+	if (end_hit)
+		end_report();
+	
+	if ((b == NULL) || stepper_busy())
+		return;
+	
+	if (curr_status.error) {
+		/* An endstop was hit, drop the rest of the queue */
+		P1IE |= (SWX | SWY);
+		P2IE |= SWZ;
+		if (b->arc && !move_phase)
+			plan_arc_pop();
+		move_phase = 0;
+		plan_pop();
+		line_waiting = 0;
+		send_string("RECAL\n");
+		send_done();
+		return;
+	}
+	
+	if (move_phase) {
+		if (b->arc && (move_phase == 1)) {
+			/* The start of the line to the target, see #end_report */
+			stepper_steps(delta);
+			curr_status.pos.x += delta[AXIS_X];
+			curr_status.pos.y += delta[AXIS_Y];
+			curr_status.pos.z = b->target.z;
+			curr_status.pos.solder = b->target.solder;
+			
+			/* From the end of the arc to the target, a few steps */
+			delta[AXIS_X] = b->target.x - curr_status.pos.x;
+			delta[AXIS_Y] = b->target.y - curr_status.pos.y;
+			delta[AXIS_Z] = 0;
+			delta[AXIS_C] = 0;
+			delta[AXIS_E] = 0;
+			move_phase = 2;
+			if (delta[AXIS_X] || delta[AXIS_Y]) {
+				stepper_move(delta, b->period);
+				return;
+			}
+		}
 		
-		move_solder(curr_status.solder, req_status.solder,
-				MIN_PULSE_PERIOD_SOLDER);
-				
-		send_string("done\n");
+		/* Endstops are disabled while the C axis is moving */
+		P1IE |= (SWX | SWY);
+		P2IE |= SWZ;
+		
+		/* Update positions */
+		curr_status.pos = b->target;
+		curr_status.rz = 0;
+		
+		move_phase = 0;
+		plan_pop();
+		line_waiting = 0;
+		send_done();
+		return;
+	}
+	
+	/* All axes move together, the C axis is relative */
+	delta[AXIS_X] = b->target.x - curr_status.pos.x;
+	delta[AXIS_Y] = b->target.y - curr_status.pos.y;
+	delta[AXIS_Z] = b->target.z - curr_status.pos.z;
+	delta[AXIS_C] = b->rz;
+	delta[AXIS_E] = b->target.solder - curr_status.pos.solder;
+	
+	if (b->rz) {
+		P1IE &= ~(SWX | SWY);
+		P2IE &= ~SWZ;
+	}
+	
+	if (b->arc) {
+		/* The arc is copied to #move_desc, another one can be queued */
+		stepper_arc(plan_arc(), delta, b->period);
+		plan_arc_pop();
 	} else {
-		send_string("RECAL\n");
-		send_string("done\n");
+		stepper_move(delta, b->period);
 	}
+	move_phase = 1;
+}
+
+/**
+ * @brief Maximum Z axis position of the current routine: the solder tip or
+ * the vacuum tip (#curr_status.solder_routine).
+ * @return Position in mm times #FIXED_ONE.
+ */
+static long z_max(void)
+{
+	return curr_status.solder_routine ? max_z_solder : max_z_component;
+}
+
+/**
+ * @brief Sets the solder routine and limits a target to the maximum positions,
+ * reporting the limits, see #queue_move.
+ * @param[in,out] target: position in steps, absolute. Limited if needed.
+ * @param[in] solder: one if the solder extruder position was sent.
+ * @return Void.
+ */
+static void limit_target(struct steps_pos *target, char solder)
+{
+	/** Maximum Z axis position in mm times #FIXED_ONE */
+	long zmax_mm;
+	/** Maximum Z axis position in steps */
+	long zmax;
+	
+	/* If no solder will be used, set Z max to vacuum tip */
+	curr_status.solder_routine = solder ? 1 : 0;
+	zmax_mm = z_max();
+	
+	if (target->x >= mm_to_steps(max_x, STEPS_PER_MM_X)) {
+		send_string("XM ");
+		print_fixed(max_x);
+		send_char('\n');
+		target->x = mm_to_steps(max_x, STEPS_PER_MM_X);
+	}
+	
+	if (target->y >= mm_to_steps(max_y, STEPS_PER_MM_Y)) {
+		send_string("YM ");
+		print_fixed(max_y);
+		send_char('\n');
+		target->y = mm_to_steps(max_y, STEPS_PER_MM_Y);
+	}
+	
+	zmax = mm_to_steps(zmax_mm, STEPS_PER_MM_Z);
+	if (target->z >= zmax) {
+		send_string("ZM ");
+		print_fixed(zmax_mm);
+		send_char('\n');
+		target->z = zmax;
+	}
+}
+
+void queue_move(struct block *b, char solder, long feed)
+{
+	limit_target(&b->target, solder);
+	
+	/* The C axis initial position must always be treated as zero */
+	plan_move(b, feed, 0);
+}
+
+signed char setup_arc(struct block *b, char solder, signed char dir,
+		      const struct words *w)
+{
+	/** Arc from the last queued position */
+	struct block_arc *arc = plan_arc_free();
+	/** Start of the arc */
+	const struct steps_pos *start = queued_pos();
+	
+	limit_target(&b->target, solder);
+	
+	arc->dir = dir;
+	if (arc_center(arc, start, &b->target,
+		       get_word(w, 'I', 0), get_word(w, 'J', 0),
+		       get_word(w, 'R', PARAM_NONE)))
+		return -1;
+	
+	/* Too small to be traced, the center is rounded to the grid */
+	return ((long)arc->x0 * arc->x0 + (long)arc->y0 * arc->y0
+		>= (long)ARC_MIN_RADIUS * ARC_MIN_RADIUS);
+}
+
+void set_position(const struct steps_pos *pos, long rz)
+{
+	
+	curr_status.pos = *pos;
+	curr_status.rz = rz;
+	curr_status.error = 0;
+	
+	send_done();
+}
+
+void set_vacuum(char on)
+{
+	/* Normally open valve */
+	if (on)
+		SET_VACUUM;
+	else
+		RESET_VACUUM;
+	
+	curr_status.vacuum = on;
+	send_done();
 }
 
 void status()
@@ -134,19 +551,19 @@ void status()
 	send_string("mm abs\n");
 	
 	send_string("X ");
-	print_float(curr_status.x);
+	print_fixed(steps_to_mm(curr_status.pos.x, STEPS_PER_MM_X));
 	send_char('\n');
 	
 	send_string("Y ");
-	print_float(curr_status.y);
+	print_fixed(steps_to_mm(curr_status.pos.y, STEPS_PER_MM_Y));
 	send_char('\n');
 	
 	send_string("Z ");
-	print_float(curr_status.z);
+	print_fixed(steps_to_mm(curr_status.pos.z, STEPS_PER_MM_Z));
 	send_char('\n');
 	
 	send_string("E ");
-	print_float(curr_status.solder);
+	print_fixed(steps_to_mm(curr_status.pos.solder, STEPS_PER_MM_S));
 	send_char('\n');
 	
 	send_string("SDR ");
@@ -156,7 +573,7 @@ void status()
 		send_string(no_str);
 	
 	send_string("ZM ");
-	print_float(curr_status.zmax);
+	print_fixed(z_max());
 	send_char('\n');
 	
 	send_string("VAC ");
@@ -183,7 +600,192 @@ void status()
 	else
 		send_string(no_str);
 	
-	send_string("done\n");
+	send_done();
+}
+
+void status_compact()
+{
+	/** Positions in steps, indexed by #axis_id */
+	long pos[DDA_AXES];
+	/** STATUS_* flags */
+	unsigned char flags = 0;
+	/** Axis counter */
+	unsigned char i;
+	static const char hex[] = "0123456789ABCDEF";
+	
+	pos[AXIS_X] = curr_status.pos.x;
+	pos[AXIS_Y] = curr_status.pos.y;
+	pos[AXIS_Z] = curr_status.pos.z;
+	pos[AXIS_C] = curr_status.rz;
+	pos[AXIS_E] = curr_status.pos.solder;
+	
+	for (i = 0; i < DDA_AXES; i++) {
+		send_char(i ? '|' : '<');
+		send_char(axes[i].letter);
+		send_char(':');
+		print_fixed(steps_to_mm(pos[i], axes[i].steps_per_unit));
+	}
+	
+	if (curr_status.calibrated)
+		flags |= STATUS_CAL;
+	if (curr_status.error)
+		flags |= STATUS_ERR;
+	if (curr_status.end_triggd)
+		flags |= STATUS_END;
+	if (curr_status.vacuum)
+		flags |= STATUS_VAC;
+	if (curr_status.solder_routine)
+		flags |= STATUS_SDR;
+	if (plan_count() || stepper_busy())
+		flags |= STATUS_RUN;
+	
+	send_string("|F:");
+	send_char(hex[flags >> 4]);
+	send_char(hex[flags & 0x0F]);
+	send_string(">\n");
+}
+
+void set_auto_report(unsigned long ms)
+{
+	/** Interval in ticks, rounded */
+	unsigned long ticks = (ms + REPORT_TICK_MS / 2) / REPORT_TICK_MS;
+	
+	stop_t0_a3_c0();
+	report_due = 0;
+	
+	if (ms && !ticks)
+		ticks = 1;
+	if (ticks > 0xFFFF)
+		ticks = 0xFFFF;
+	report_ticks = ticks;
+	report_left = ticks;
+	
+	if (ticks)
+		start_t0_a3_c0_it(SMCLK_HZ / 1000 * REPORT_TICK_MS);
+}
+
+void auto_report()
+{
+	if (!report_due)
+		return;
+	
+	report_due = 0;
+	status_compact();
+}
+
+void load_report()
+{
+	/** SMCLK cycles awake and total since the last report */
+	unsigned long busy;
+	unsigned long total;
+	
+	cpu_load(&busy, &total);
+	
+	/* Per mille, scaled down so busy times 1000 fits in 32 bits */
+	while (total >= 0x400000UL) {
+		busy >>= 1;
+		total >>= 1;
+	}
+	
+	send_string("CPU ");
+	print_decimal(total ? (long)((busy * 1000 + total / 2) / total) : 0,
+		      1, 1);
+	send_string("%\n");
+	send_done();
+}
+
+void stack_report()
+{
+	/** Bytes reached by the stack */
+	unsigned int used;
+	/** Bytes never reached */
+	unsigned int left = stack_free(&used);
+	
+	send_string("STACK ");
+	print_int(used);
+	send_string(" FREE ");
+	print_int(left);
+	send_char('\n');
+	send_done();
+}
+
+void sleep_idle()
+{
+	/** Something for the main loop to do */
+	char work;
+	
+	__disable_interrupt();
+	work = report_due || end_hit
+		|| (execute_routine ? !line_waiting
+			: ((rx_head != rx_tail) || rx_xoff))
+		|| (!stepper_busy() && plan_count());
+	if (!work)
+		cpu_sleep();
+	__enable_interrupt();
+}
+
+void jitter_report()
+{
+	/** Statistics since the last report */
+	struct step_jitter j;
+	/** Bin counter */
+	unsigned char i;
+	
+	jitter_take(&j);
+	
+	send_string("\nJIT MIN ");
+	print_int(j.max ? j.min : 0);
+	send_string("\nJIT MAX ");
+	print_int(j.max);
+	send_char('\n');
+	
+	/* Lower bound of each bin in cycles and its count of steps */
+	for (i = 0; i < JITTER_BINS; i++) {
+		send_string("JIT ");
+		print_int((long)i << JITTER_BIN_SHIFT);
+		send_char(' ');
+		print_int(j.hist[i]);
+		send_char('\n');
+	}
+	
+	send_done();
+}
+
+/**
+ * @brief Parses the axes words of a G-code line (X, Y, Z, C and E, see #axes)
+ * and converts them to steps. Axes not in the line are left untouched.
+ * @param[in] w: words of the line (#parse_line).
+ * @param[in,out] pos: position in steps, absolute.
+ * @param[in,out] rz: C axis position in steps.
+ * @return Mask of the parsed axes, bit n is set for #axis_id n.
+ */
+static unsigned char parse_axes(const struct words *w, struct steps_pos *pos,
+			       long *rz)
+{
+	/** Destination of each axis, indexed by #axis_id */
+	long *dest[DDA_AXES];
+	/** Axis counter */
+	unsigned char i;
+	/** Parsed parameter in mm times #FIXED_ONE */
+	long param;
+	/** Parsed axes */
+	unsigned char mask = 0;
+	
+	dest[AXIS_X] = &pos->x;
+	dest[AXIS_Y] = &pos->y;
+	dest[AXIS_Z] = &pos->z;
+	dest[AXIS_C] = rz;
+	dest[AXIS_E] = &pos->solder;
+	
+	for (i = 0; i < DDA_AXES; i++) {
+		param = get_word(w, axes[i].letter, PARAM_NONE);
+		if (param != PARAM_NONE) {
+			*dest[i] = mm_to_steps(param, axes[i].steps_per_unit);
+			mask |= 1 << i;
+		}
+	}
+	
+	return mask;
 }
 
 void eval_command()
@@ -191,66 +793,99 @@ void eval_command()
 	if (!execute_routine)
 		return;
 
+	/** Words of the line */
+	struct words w;
 	/** G/M-code to be executed */
 	int cmd = 0;
+	/** M-code to be executed after the G-code */
+	int mcmd = 0;
 	/** Parsed G-code is unknown? 1 if yes*/
 	char uknown_gc = 0;
 	/** Parsed M-code is unknown? 1 if yes*/
 	char uknown_mc = 0;
+	/** Parsed parameter in mm times #FIXED_ONE, #PARAM_NONE if not sent */
+	long param;
+	/**
+	 * Block filled in place with the target position in steps (#plan_free),
+	 * there is room for it whenever the line is executed
+	 */
+	struct block *b;
+	/** Axes sent in the line, see #parse_axes */
+	unsigned char mask;
+	/** Arc argument of #plan_move, see #setup_arc */
+	signed char arc;
+	/** New baud rate (M575), switched after the line is cleared */
+	unsigned long baud = 0;
 
-	/* Get the G-code */
-	cmd = parse_param('G', -1);
+	/* Get the words, the G-code and the M-code */
+	if (parse_line(&w)) {
+		send_string("PARSE?\n");
+		send_done();
+		memset(rx_data_raw, 0, RX_STR_SIZE);
+		execute_routine = 0;
+		if (ack_ok)
+			send_ok();
+		return;
+	}
+	cmd = get_word(&w, 'G', -1);
+	mcmd = get_word(&w, 'M', -1);
+	
+	/*
+	 * Moves wait for room in the queue, arcs for the queued arc to be
+	 * started too, and any other command waits for the queued moves to be
+	 * executed. Until then the line is kept in
+	 * #rx_data_raw and evaluated again in the next call.
+	 */
+	line_waiting = ((cmd >= 0) && (cmd <= 3))
+		? ((plan_count() >= BLOCK_QUEUE_SIZE)
+		   || ((cmd >= 2) && plan_arc()))
+		: (plan_count() != 0);
+	if (line_waiting)
+		return;
 	
 	switch(cmd) {
 	case 0:
 	case 1:
-	/* Move to a specific point */
-		req_status.x = parse_param('X', curr_status.x);
-		req_status.y = parse_param('Y', curr_status.y);
-		req_status.z = parse_param('Z', curr_status.z);
-		req_status.rz = parse_param('C', curr_status.rz);
-		req_status.solder = parse_param('E', FLT_MAX);
+	case 2:
+	case 3:
+	/* Move to a specific point, relative to the last queued move */
+		b = plan_free();
+		b->target = *queued_pos();
+		b->rz = curr_status.rz;
+		mask = parse_axes(&w, &b->target, &b->rz);
 		
-		/* If no solder will be used, set Z max to vacuum tip */		
-		if (req_status.solder == FLT_MAX) {
-			/* Will not solder */
-			req_status.solder = curr_status.solder;
-			
-			req_status.zmax = max_z_component;
-			req_status.solder_routine = 0;
-			
-			curr_status.zmax = max_z_component;
-			curr_status.solder_routine = 0;
+		/* Modal feedrate, G0 ignores it */
+		param = get_word(&w, 'F', PARAM_NONE);
+		if ((param != PARAM_NONE) && (param > 0))
+			feedrate = param;
+		
+		/*
+		 * The center of an arc is found, then its iterations are
+		 * counted (the end is a few steps away from the target at
+		 * most) and then it is queued: none of them nests in another
+		 */
+		if (cmd < 2) {
+			queue_move(b, mask & (1 << AXIS_E), cmd ? feedrate : 0);
 		} else {
-			req_status.zmax = max_z_solder;
-			req_status.solder_routine = 1;
-			
-			curr_status.zmax = max_z_solder;
-			curr_status.solder_routine = 1;
-		}
-
-		if (req_status.x >= max_x) {
-			send_string("XM ");
-			print_float(max_x);
-			send_char('\n');
-			req_status.x = max_x;
-		}
-
-		if (req_status.y >= max_y) {
-			send_string("YM ");
-			print_float(max_y);
-			send_char('\n');
-			req_status.y = max_y;
+			arc = setup_arc(b, mask & (1 << AXIS_E),
+					(cmd == 3) ? 1 : -1, &w);
+			if ((arc > 0) && arc_plan(plan_arc_free()))
+				arc = -1;
+			if (arc >= 0) {
+				plan_move(b, feedrate, arc);
+			} else {
+				send_string("ARC?\n");
+				send_done();
+			}
 		}
-
-		if (req_status.z >= req_status.zmax) {
-			send_string("ZM ");
-			print_float(curr_status.zmax);
-			send_char('\n');
-			req_status.z = curr_status.zmax;
+		
+		/* M-codes in the same line act after the move */
+		if (mcmd != -1) {
+			while (plan_count()) {
+				stepper_wait();
+				move();
+			}
 		}
-
-		move();
 		break;
 	case 33:
 	/* Auto calibration */
@@ -258,42 +893,75 @@ void eval_command()
 		break;
 	case 92:
 	/* Set current position (manual calibration) */
-		req_status.error = 0;
-		curr_status.x = parse_param('X', curr_status.x);
-		curr_status.y = parse_param('Y', curr_status.y);
-		curr_status.z = parse_param('Z', curr_status.z);
-		curr_status.rz = parse_param('C', curr_status.rz);
-		curr_status.solder = parse_param('E', curr_status.solder);
-		curr_status.error = 0;
-		send_string("done\n");
+		b = plan_free();
+		b->target = curr_status.pos;
+		b->rz = curr_status.rz;
+		parse_axes(&w, &b->target, &b->rz);
+		
+		set_position(&b->target, b->rz);
 		break;
 	default:
 		uknown_gc = 1;
 		break;
 	}
 	
-	/* Get the M-code */
-	cmd = parse_param('M', -1);
-	
-	switch(cmd) {
+	switch(mcmd) {
 	case 10: /* vacuum on */
-	
-		/* pulse the excitor coil? */
-		req_status.vacuum = 1;
-		/* Normally open valve */
-		SET_VACUUM;
-		curr_status.vacuum = 1;
-		send_string("done\n");
+		set_vacuum(1);
 		break;
 	case 11: /* vacuum off */
-		req_status.vacuum = 0;
-		/* Normally open valve */
-		RESET_VACUUM;
-		curr_status.vacuum = 0;
-		send_string("done\n");
+		set_vacuum(0);
+		break;
+	case 12: /* echo on */
+		uart_echo = 1;
+		send_done();
+		break;
+	case 13: /* echo off */
+		uart_echo = 0;
+		send_done();
+		break;
+	case 14: /* acknowledge with "ok" once buffered */
+		ack_ok = 1;
+		break;
+	case 15: /* acknowledge with "done" once performed */
+		ack_ok = 0;
+		send_done();
 		break;
 	case 114:
-		status();
+		if (get_word(&w, 'S', 0) == FIXED_ONE) {
+			status_compact();
+			send_done();
+		} else {
+			status();
+		}
+		break;
+	case 154: /* status auto-report */
+		param = get_word(&w, 'S', PARAM_NONE);
+		if (param != PARAM_NONE)
+			set_auto_report((param > 0) ? param / 1000 : 0);
+		send_done();
+		break;
+	case 801: /* step timing statistics */
+		jitter_report();
+		break;
+	case 802: /* CPU load */
+		load_report();
+		break;
+	case 803: /* stack high-water mark */
+		stack_report();
+		break;
+	case 575: /* serial port settings */
+		param = get_word(&w, 'S', PARAM_NONE);
+		if (param != PARAM_NONE)
+			uart_xonxoff = (param != 0);
+		param = get_word(&w, 'B', PARAM_NONE);
+		if (param != PARAM_NONE) {
+			if (baud_supported(param))
+				baud = param;
+			else
+				send_string("BAUD?\n");
+		}
+		send_done();
 		break;
 	default:
 		uknown_mc = 1;
@@ -302,212 +970,147 @@ void eval_command()
 	
 	if (uknown_gc && uknown_mc) {
 		send_string("G/M-Code?\n");
-		send_string("done\n");
+		send_done();
 	}
 	
 	memset(rx_data_raw, 0, RX_STR_SIZE);	
 	
 	execute_routine = 0;
+	if (ack_ok)
+		send_ok();
+	
+	/* The reply was sent at the previous baud rate */
+	if (baud)
+		change_baud_rate(baud);
 }
 
-void move_solder(float p1f, float p2f, unsigned int period)
+/**
+ * @brief Reads a little-endian int32 from a binary frame.
+ * @param[in] p: first byte.
+ * @return The number.
+ */
+static long get_long(const char *p)
 {
-	long int p1 = p1f*STEPS_PER_MM_S;
-	long int p2 = p2f*STEPS_PER_MM_S;
-	
-	long int ps;
-	
-	ps = (p2 > p1) ? 1 : -1;
-	
-	/* Positive downwards */
-	if (ps == 1)
-		RESET_DIR_S;
-	else
-		SET_DIR_S;
-	
-	start_t1_a3_c0(period);
-	
-	while((p1 != p2)) {
-		p1 += ps;
-		
-		/* Move solder */
-		TOGGLE_STEPS_S;
-		
-		/* Wait. If an endstop is hit, stop the machine */
-		while(!(TA1CTL & TAIFG));
-		TA1CTL &= ~TAIFG;
-	}
-	stop_t1_a3_c0();
-	
-	/* Update position */
-	curr_status.solder = req_status.solder;
+	return (long)((unsigned long)(unsigned char)p[0]
+		| ((unsigned long)(unsigned char)p[1] << 8)
+		| ((unsigned long)(unsigned char)p[2] << 16)
+		| ((unsigned long)(unsigned char)p[3] << 24));
 }
 
-void move_rz(float p1f, float p2f, unsigned int period)
+/**
+ * @brief Reads the axes mask and positions of #BIN_MOVE and #BIN_SET_POS.
+ * Axes not in the mask are not changed.
+ * @param[in] p: payload.
+ * @param[in] len: payload length.
+ * @param[in,out] pos: X, Y, Z and solder extruder positions in steps.
+ * @param[in,out] rz: C axis position in steps.
+ * @return The axes mask or -1 if the length does not match the mask.
+ */
+static int get_axes(const char *p, unsigned char len, struct steps_pos *pos,
+		    long *rz)
 {
-	P1IE &= ~(SWX | SWY);
-	P2IE &= ~SWZ;
+	/** Axes in the payload, the same order as the mask bits */
+	long *axes[5];
+	/** Axes mask */
+	unsigned char mask;
+	/** Axis counter */
+	int i;
 	
-	long int p1 = p1f*STEPS_PER_DEG_RZ;
-	long int p2 = p2f*STEPS_PER_DEG_RZ;
-
-	long int ps;
+	axes[0] = &pos->x;
+	axes[1] = &pos->y;
+	axes[2] = &pos->z;
+	axes[3] = rz;
+	axes[4] = &pos->solder;
 	
-	ps = (p2 > p1) ? 1 : -1;
+	if (len < 1)
+		return -1;
 	
-	/* Positive clockwise */
-	if (ps == 1)
-		SET_DIR_RZ;
-	else
-		RESET_DIR_RZ;
+	mask = *p++;
+	len--;
 	
-	start_t1_a3_c0(period);
-	
-	while((p1 != p2)) {
-		p1 += ps;
-		
-		/* Move rz */
-		TOGGLE_STEPS_RZ;
-		
-		/* Wait. If an endstop is hit, stop the machine */
-		while(!(TA1CTL & TAIFG));
-		TA1CTL &= ~TAIFG;
+	for (i = 0; i < 5; i++) {
+		if (!(mask & (1 << i)))
+			continue;
+		if (len < 4)
+			return -1;
+		*axes[i] = get_long(p);
+		p += 4;
+		len -= 4;
 	}
-	stop_t1_a3_c0();
-	
-	/* Update position */
-	curr_status.rz = 0;
-	req_status.rz = 0;
 	
-	P1IE |= (SWX | SWY);
-	P2IE |= SWZ;
+	return len ? -1 : mask;
 }
 
-void bresenham_3d(float x1f, float y1f, float z1f,
-		  float x2f, float y2f, float z2f,
-		  unsigned int period)
+void eval_binary()
 {
-	long int x1 = x1f*STEPS_PER_MM_X;
-	long int y1 = y1f*STEPS_PER_MM_Y;
-	long int z1 = z1f*STEPS_PER_MM_Z;
-	
-	long int x2 = x2f*STEPS_PER_MM_X;
-	long int y2 = y2f*STEPS_PER_MM_Y;
-	long int z2 = z2f*STEPS_PER_MM_Z;
-	
-	long int dx = labs(x2 - x1);
-	long int dy = labs(y2 - y1);
-	long int dz = labs(z2 - z1);
+	/** Command byte */
+	unsigned char cmd = rx_data_raw[1];
+	/** Sequence number */
+	unsigned char seq = rx_data_raw[2];
+	/** Payload length */
+	unsigned char len = rx_data_raw[3];
+	/** Payload */
+	const char *payload = &rx_data_raw[BIN_HEADER_SIZE];
+	/** Block filled in place with the target position, see #eval_command */
+	struct block *b = plan_free();
+	/** Axes mask */
+	int mask;
 	
-	long int xs;
-	long int ys;
-	long int zs;
-	
-	long int p1;
-	long int p2;
-	
-	/* Same as direction for the drivers but with 0 and 1 */
-	xs = (x2 > x1) ? 1 : -1;
-	ys = (y2 > y1) ? 1 : -1;
-	zs = (z2 > z1) ? 1 : -1;
-	
-	if (xs == 1)
-		SET_DIR_X;
-	else
-		RESET_DIR_X;
-
-	if (ys == 1)
-		RESET_DIR_Y;
-	else
-		SET_DIR_Y;
-
-	if (zs == 1)
-		SET_DIR_Z;
-	else
-		RESET_DIR_Z;
-	
-	start_t1_a3_c0(period);
+	/* Same rules as #eval_command for the planner queue */
+	line_waiting = (cmd == BIN_MOVE)
+		? (plan_count() >= BLOCK_QUEUE_SIZE) : (plan_count() != 0);
+	if (line_waiting)
+		return;
 	
-	/* Drive X axis */
-	if ((dx >= dy) && (dx >= dz)) {
-		p1 = 2*dy - dx;
-		p2 = 2*dz - dx;
-		
-		while ((x1 != x2)) {
-			TOGGLE_STEPS_X;
-			x1 += xs;
-			if (p1 >= 0) {
-				TOGGLE_STEPS_Y;
-				y1 += ys;
-				p1 -= 2*dx;
-			}
-			if (p2 >= 0) {
-				TOGGLE_STEPS_Z;
-				z1 += zs;
-				p2 -= 2*dx;
-			}
-			p1 += 2*dy;
-			p2 += 2*dz;
-			
-			/* Wait. If an endstop is hit, stop the machine */
-			while(!(TA1CTL & TAIFG));
-			TA1CTL &= ~TAIFG;
-		}
-	/* Drive Y Axis */
-	} else if ((dy >= dx) && (dy >= dz)) {
-		p1 = 2*dx - dy;
-		p2 = 2*dz - dy;
-		
-		while ((y1 != y2)) {
-			TOGGLE_STEPS_Y;
-			y1 += ys;
-			if (p1 >= 0) {
-				TOGGLE_STEPS_X;
-				x1 += xs;
-				p1 -= 2*dy;
-			}
-			if (p2 >= 0) {
-				TOGGLE_STEPS_Z;
-				z1 += zs;
-				p2 -= 2*dy;
-			}
-			p1 += 2*dx;
-			p2 += 2*dz;
-			
-			/* Wait. If an endstop is hit, stop the machine */
-			while(!(TA1CTL & TAIFG));
-			TA1CTL &= ~TAIFG;
-		}
-	/* Drive Z Axis */
+	if (!frame_valid()) {
+		send_frame(BIN_NAK, seq);
 	} else {
-		p1 = 2*dy - dz;
-		p2 = 2*dx - dz;
-		
-		while ((z1 != z2)) {
-			TOGGLE_STEPS_Z;
-			z1 += zs;
-			if (p1 >= 0) {
-				TOGGLE_STEPS_Y;
-				y1 += ys;
-				p1 -= 2*dz;
+		switch (cmd) {
+		case BIN_MOVE:
+			b->target = *queued_pos();
+			b->rz = curr_status.rz;
+			mask = get_axes(payload, len, &b->target, &b->rz);
+			if (mask < 0) {
+				send_frame(BIN_NAK, seq);
+				break;
 			}
-			if (p2 >= 0) {
-				TOGGLE_STEPS_X;
-				x1 += xs;
-				p2 -= 2*dz;
+			send_frame(cmd | BIN_ACK, seq);
+			queue_move(b, mask & BIN_AXIS_E, feedrate);
+			break;
+		case BIN_CALIBRATE:
+			send_frame(cmd | BIN_ACK, seq);
+			calibrate();
+			break;
+		case BIN_SET_POS:
+			b->target = curr_status.pos;
+			b->rz = curr_status.rz;
+			mask = get_axes(payload, len, &b->target, &b->rz);
+			if (mask < 0) {
+				send_frame(BIN_NAK, seq);
+				break;
 			}
-			p1 += 2*dy;
-			p2 += 2*dx;
-
-			/* Wait. If an endstop is hit, stop the machine */
-			while(!(TA1CTL & TAIFG));
-			TA1CTL &= ~TAIFG;
+			send_frame(cmd | BIN_ACK, seq);
+			set_position(&b->target, b->rz);
+			break;
+		case BIN_VACUUM:
+			if (len != 1) {
+				send_frame(BIN_NAK, seq);
+				break;
+			}
+			send_frame(cmd | BIN_ACK, seq);
+			set_vacuum(payload[0] != 0);
+			break;
+		case BIN_STATUS:
+			send_frame(cmd | BIN_ACK, seq);
+			status();
+			break;
+		default:
+			send_frame(BIN_NAK, seq);
+			break;
 		}
 	}
-	stop_t1_a3_c0();
 	
-	/* Update positions */
-	curr_status.x = req_status.x;
-	curr_status.y = req_status.y;
-	curr_status.z = req_status.z;
+	memset(rx_data_raw, 0, RX_STR_SIZE);
+	rx_binary = 0;
+	execute_routine = 0;
 }
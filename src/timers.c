@@ -8,17 +8,26 @@
 #include "sys_config.h"
 #include "timers.h"
 
+volatile unsigned int clock_ovf;
+volatile unsigned long isr_cycles;
+/** Start of the CPU load window (#clock_cycles) */
+static unsigned long load_start;
+/** SMCLK cycles slept since #load_start */
+static unsigned long sleep_cycles;
+
 void start_t1_a3_c0_it(unsigned int period)
 {
 	/* Configure and start Timer1_A3.TA0 to generate pulses
 	 * Stop the clock
-	 * set interrupts period
+	 * set interrupts period, CCR1 and CCR2 follow it for the step outputs
+	 * keep the TA1.0 output mode
 	 * set source as SMCLK (8 MHz, up mode, clear timer control)
 	 */
 	TA1CTL = MC_0;
 	TA1CCR0 = period;
-	TA1CCR1 = 0;
-	TA1CCTL0 = CCIE;
+	TA1CCR1 = period;
+	TA1CCR2 = period;
+	TA1CCTL0 = (TA1CCTL0 & (OUTMOD_7 | OUT)) | CCIE;
 	TA1CTL = TASSEL_2 | MC_1 | TACLR;
 }
 
@@ -40,3 +49,89 @@ void stop_t1_a3_c0(void)
 	TA1CTL = MC_0 | TACLR;
 	TA1CCTL0 &= ~CCIE;
 }
+
+void start_t0_a3_clock(void)
+{
+	/* Configure and start Timer0_A3 as the free running clock
+	 * Stop the clock
+	 * enable the overflow interruption (#clock_ISR)
+	 * set source as SMCLK (8 MHz, continuous mode, clear timer control)
+	 */
+	TA0CTL = MC_0;
+	clock_ovf = 0;
+	TA0CCTL0 = 0;
+	TA0CTL = TASSEL_2 | MC_2 | TACLR | TAIE;
+	load_start = 0;
+	sleep_cycles = 0;
+}
+
+unsigned long clock_cycles(void)
+{
+	/** Interruptions state to be restored */
+	unsigned int gie = __get_SR_register() & GIE;
+	/** Counter */
+	unsigned int lo;
+	/** Overflows */
+	unsigned int hi;
+	
+	__disable_interrupt();
+	hi = clock_ovf;
+	lo = TA0R;
+	/* Overflow not handled yet */
+	if ((TA0CTL & TAIFG) && (lo < 0x8000))
+		hi++;
+	__bis_SR_register(gie);
+	
+	return ((unsigned long)hi << 16) | lo;
+}
+
+void start_t0_a3_c0_it(unsigned int period)
+{
+	/* First CCR0 event one period from now, #report_ISR schedules the next */
+	TA0CCTL0 = 0;
+	TA0CCR0 = TA0R + period;
+	TA0CCTL0 = CCIE;
+}
+
+void stop_t0_a3_c0(void)
+{
+	TA0CCTL0 = 0;
+}
+
+void cpu_sleep(void)
+{
+	/** Time the CPU went to sleep */
+	unsigned long start = clock_cycles();
+	/** Time it woke up */
+	unsigned long now;
+	/** Interruption handlers time so far, they run while sleeping */
+	unsigned long isr = isr_cycles;
+	
+	__bis_SR_register(IDLE_LPM_BITS | GIE);
+	__disable_interrupt();
+	
+	now = clock_cycles();
+	sleep_cycles += (now - start) - (isr_cycles - isr);
+	
+	/* Keep the window inside 32 bits, halving both keeps the ratio */
+	if (now - load_start >= 0x80000000UL) {
+		sleep_cycles >>= 1;
+		load_start = now - ((now - load_start) >> 1);
+	}
+}
+
+void cpu_load(unsigned long *busy, unsigned long *total)
+{
+	/** Interruptions state to be restored */
+	unsigned int gie = __get_SR_register() & GIE;
+	/** Current time */
+	unsigned long now;
+	
+	__disable_interrupt();
+	now = clock_cycles();
+	*total = now - load_start;
+	*busy = *total - sleep_cycles;
+	load_start = now;
+	sleep_cycles = 0;
+	__bis_SR_register(gie);
+}
@@ -7,47 +7,353 @@
  */
 
 #include <msp430.h>
-#include <stdlib.h>
-#include <float.h>
 #include <string.h>
-#include <ctype.h>
 
 #include "usart.h"
 #include "sys_config.h"
 #include "timers.h"
 
+char rx_data_raw[RX_STR_SIZE];
+char rx_ring[RX_RING_SIZE];
+volatile unsigned char rx_head;
+volatile unsigned char rx_tail;
+char tx_ring[TX_RING_SIZE];
+volatile unsigned char tx_tail;
+volatile unsigned char tx_count;
+volatile char uart_echo = 1;
+char rx_binary;
+volatile char uart_xonxoff;
+volatile char rx_xoff;
+volatile char tx_flow;
+
+/** Supported baud rates, the UART dividers are computed from SMCLK */
+static const unsigned long baud_rates[] = {
+	9600, 19200, 38400, 57600, 115200
+};
+/** Number of supported baud rates */
+#define BAUD_RATES (sizeof(baud_rates) / sizeof(baud_rates[0]))
+/** Current baud rate, index in #baud_rates */
+static unsigned char uart_rate;
+
+/**
+ * @brief Finds a baud rate in #baud_rates.
+ * @param[in] baud: baud rate in bps.
+ * @return Its index, #BAUD_RATES if it is not supported.
+ */
+static unsigned char rate_index(unsigned long baud)
+{
+	/** Table index */
+	unsigned char i;
+	
+	for (i = 0; i < BAUD_RATES; i++) {
+		if (baud_rates[i] == baud)
+			break;
+	}
+	
+	return i;
+}
+
+/**
+ * @brief Sets the USCIAB0 dividers for a baud rate in oversampling mode.
+ *
+ * N = SMCLK/baud, UCBRx = INT(N/16) and UCBRFx = ROUND(N - 16*UCBRx)
+ * (SLAU144J, 15.3.10). Valid while N >= 16.
+ * @param[in] baud: baud rate in bps.
+ * @return Void.
+ */
+static void set_uart_dividers(unsigned long baud)
+{
+	/** SMCLK/baud, rounded */
+	unsigned int n = (SMCLK_HZ + baud / 2) / baud;
+	
+	UCA0CTL1 |= UCSWRST;
+	UCA0BR0 = (n >> 4) & 0xFF;
+	UCA0BR1 = (n >> 12) & 0xFF;
+	UCA0MCTL = UCBRS_0 | UCOS16 | ((n & 0x0F) << 4);
+	UCA0CTL1 &= ~UCSWRST;
+	IFG2 &= ~(UCA0RXIFG);
+	IE2 |= UCA0RXIE;
+}
+
 void config_uart_usart0(void)
 {
 	/* 
 	 * Configure UART
 	 *
 	 * Select SMCLK (8 MHz)
-	 * Adjust clk division to 9600 baud (LaunchPad maximum)
+	 * Adjust clk division to UART_DEFAULT_BAUD, M575 changes it later
 	 * Adjust modulation to fine tune the baud rate
 	 * Initialize USCI
 	 * Enable RX interruptions
-	 * SLAU144J expected error: max TX (-0,4% 0%) max rx (-0,4% 0,1%)
+	 * SLAU144J expected error at 9600 baud: max TX (-0,4% 0%)
+	 * max rx (-0,4% 0,1%)
 	 */
 	UCA0CTL1 |= UCSWRST;
 	UCA0CTL0 = 0;
 	UCA0CTL1 |= UCSSEL_2;
-	UCA0BR0 = 52;
-	UCA0BR1 = 0;
-	UCA0MCTL = UCBRS_0 | UCOS16 | UCBRF_1;
-	UCA0CTL1 &= ~UCSWRST;
-	IFG2 &= ~(UCA0RXIFG);
-	IE2 |= UCA0RXIE;
+	uart_rate = rate_index(UART_DEFAULT_BAUD);
+	set_uart_dividers(UART_DEFAULT_BAUD);
+	
+	/* TX interruption is enabled by #send_char when there is data */
+	rx_head = 0;
+	rx_tail = 0;
+	tx_tail = 0;
+	tx_count = 0;
+	rx_xoff = 0;
+	tx_flow = 0;
+}
+
+char baud_supported(unsigned long baud)
+{
+	return (rate_index(baud) < BAUD_RATES);
+}
+
+void change_baud_rate(unsigned long baud)
+{
+	/** Rate to go back to if the host does not confirm */
+	unsigned char old_rate = uart_rate;
+	/** Elapsed time in ms */
+	unsigned int t;
+	/** Words of a line received at the new rate */
+	struct words w;
+	
+	if (!baud_supported(baud) || (rate_index(baud) == uart_rate))
+		return;
+	
+	/* Everything queued must leave at the old rate */
+	while ((UCA0STAT & UCBUSY) || tx_count || tx_flow);
+	
+	set_uart_dividers(baud);
+	uart_rate = rate_index(baud);
+	
+	/*
+	 * A G/M-code line or a frame received intact at the new rate confirms
+	 * it, bytes received at another rate are discarded
+	 */
+	for (t = 0; t < BAUD_CONFIRM_MS; t++) {
+		read_line();
+		if (execute_routine) {
+			if (rx_binary ? frame_valid()
+			    : (!parse_line(&w) && (w.at[WORD_G] || w.at[WORD_M])))
+				return;
+			execute_routine = 0;
+		}
+		__delay_cycles(SMCLK_HZ / 1000);
+	}
+	
+	/* Discard what was received at the wrong rate */
+	set_uart_dividers(baud_rates[old_rate]);
+	uart_rate = old_rate;
+	rx_tail = rx_head;
 }
 
 void send_char(char c)
 {
-	/* Wait while something is transmitted */
-	while (!(IFG2 & UCA0TXIFG));
+	/** Interruptions state to be restored */
+	unsigned int gie = __get_SR_register() & GIE;
 	
-	UCA0TXBUF = c;
+	/* Also called from ISRs, the ring must not be changed meanwhile */
+	__disable_interrupt();
 	
-	/* Wait while UART is transmitting the byte */
-	while (UCA0STAT & UCBUSY);
+	while (tx_count >= TX_RING_SIZE) {
+		/*
+		 * Ring full: let #transmit_data_ISR make room, a busy wait with
+		 * the interruptions disabled would delay the steps by a byte.
+		 */
+		if (gie) {
+			__enable_interrupt();
+			__no_operation();
+			__disable_interrupt();
+			continue;
+		}
+		
+		/* Called from an ISR: move the oldest byte to the USCI by hand */
+		while (!(IFG2 & UCA0TXIFG));
+		UCA0TXBUF = tx_ring[tx_tail];
+		tx_tail = (tx_tail + 1) & (TX_RING_SIZE - 1);
+		tx_count--;
+	}
+	
+	tx_ring[(tx_tail + tx_count) & (TX_RING_SIZE - 1)] = c;
+	tx_count++;
+	
+	/* The TX interruption will send it as soon as the USCI is free */
+	IE2 |= UCA0TXIE;
+	
+	__bis_SR_register(gie);
+}
+
+void read_line(void)
+{
+	/** Position of the next character in #rx_data_raw */
+	static unsigned char i;
+	/**
+	 * Size of the binary frame being received, zero for ASCII lines, -1
+	 * while a frame too long is discarded
+	 */
+	static signed char frame_size;
+	/** Size of a frame from its length byte, up to 255 + its header */
+	int n;
+	/** Discarding a comment: 1 up to ')', 2 up to the end of the host line */
+	static char skip;
+	/** Character read from the ring */
+	char c;
+	/** Interruptions state to be restored */
+	unsigned int gie;
+	
+	/* The previous line was not evaluated yet */
+	if (execute_routine)
+		return;
+	
+	/* The ring was emptied after a XOFF, the host may send again */
+	if (rx_xoff && (((rx_head - rx_tail) & (RX_RING_SIZE - 1))
+		<= RX_XON_LEVEL)) {
+		gie = __get_SR_register() & GIE;
+		__disable_interrupt();
+		rx_xoff = 0;
+		tx_flow = XON;
+		IE2 |= UCA0TXIE;
+		__bis_SR_register(gie);
+	}
+	
+	while (rx_tail != rx_head) {
+		c = rx_ring[rx_tail];
+		rx_tail = (rx_tail + 1) & (RX_RING_SIZE - 1);
+		
+		/*
+		 * The start of frame byte is not ASCII, it starts a binary
+		 * frame anywhere and discards an incomplete line.
+		 */
+		if ((frame_size <= 0) && ((unsigned char)c == BIN_SOF)) {
+			i = 0;
+			frame_size = BIN_HEADER_SIZE;
+			skip = 0;
+		}
+		
+		if (frame_size < 0)
+			continue;
+		
+		rx_data_raw[i] = c;
+		
+		if (frame_size) {
+			/* The size is known after the length byte */
+			if (i == BIN_HEADER_SIZE - 1) {
+				n = BIN_HEADER_SIZE + BIN_CRC_SIZE
+					+ (unsigned char)c;
+				/*
+				 * Too long: NAK it, its payload is discarded
+				 * up to the next frame
+				 */
+				if (n > RX_STR_SIZE) {
+					send_frame(BIN_NAK, rx_data_raw[2]);
+					frame_size = -1;
+					i = 0;
+					continue;
+				}
+				frame_size = n;
+			}
+			if (++i >= frame_size) {
+				frame_size = 0;
+				i = 0;
+				rx_binary = 1;
+				execute_routine = 1;
+				return;
+			}
+			continue;
+		}
+		
+		/* Echo received character */
+		if (uart_echo)
+			send_char(c);
+		
+		/*
+		 * The line was evaluated at '(', the comment is discarded up to
+		 * ')' or the end of the host line. Only a terminator right after
+		 * ')' is discarded too, anything else starts the next line.
+		 */
+		if (skip == 1) {
+			if (c == ')')
+				skip = 2;
+			else if ((c == '\0') || (c == '\n'))
+				skip = 0;
+			continue;
+		}
+		if (skip == 2) {
+			if (c == '\r')
+				continue;
+			skip = 0;
+			if ((c == '\0') || (c == '\n'))
+				continue;
+		}
+		
+		/*
+		 * if the buffer is full or a terminator was received, allow
+		 * the line to be evaluated. The last byte is kept as '\0'.
+		 */
+		if ((i >= RX_STR_SIZE - 2) || (c == '\0') || (c == ';')
+			|| (c == '*') || (c == '(')) {
+			rx_data_raw[i + 1] = '\0';
+			skip = (c == '(');
+			i = 0;
+			rx_binary = 0;
+			execute_routine = 1;
+			return;
+		}
+		i++;
+	}
+}
+
+unsigned int crc16(const char *data, int len)
+{
+	/** CRC register */
+	unsigned int crc = 0xFFFF;
+	/** Bit counter */
+	int b;
+	
+	while (len--) {
+		crc ^= (unsigned int)(unsigned char)*data++ << 8;
+		for (b = 0; b < 8; b++) {
+			if (crc & 0x8000)
+				crc = (crc << 1) ^ 0x1021;
+			else
+				crc <<= 1;
+		}
+	}
+	
+	/* Bits above 15 only exist if int is wider than 16 bits */
+	return crc & 0xFFFF;
+}
+
+char frame_valid(void)
+{
+	/** Payload length */
+	unsigned char len = rx_data_raw[3];
+	/** CRC sent with the frame */
+	unsigned int crc = (unsigned char)rx_data_raw[BIN_HEADER_SIZE + len]
+		| ((unsigned int)(unsigned char)rx_data_raw[BIN_HEADER_SIZE
+							   + len + 1] << 8);
+	
+	return crc16(&rx_data_raw[1], BIN_HEADER_SIZE - 1 + len) == crc;
+}
+
+void send_frame(unsigned char cmd, unsigned char seq)
+{
+	/** Frame without start byte and CRC */
+	char frame[BIN_HEADER_SIZE - 1];
+	/** Frame CRC */
+	unsigned int crc;
+	
+	frame[0] = cmd;
+	frame[1] = seq;
+	frame[2] = 0;
+	crc = crc16(frame, sizeof(frame));
+	
+	send_char((char)BIN_SOF);
+	send_char(frame[0]);
+	send_char(frame[1]);
+	send_char(frame[2]);
+	send_char(crc & 0xFF);
+	send_char(crc >> 8);
 }
  
 void send_string(char *str)
@@ -57,109 +363,221 @@ void send_string(char *str)
 		send_char(str[i]);
 }
 
-void print_float(float f)
+/** Powers of ten of the digits of a 32-bit number, most significant first */
+static const unsigned long pow10[] = {
+	1000000000UL, 100000000UL, 10000000UL, 1000000UL, 100000UL, 10000UL,
+	1000UL, 100UL, 10UL, 1UL
+};
+/** Number of digits of a 32-bit number */
+#define POW10_N (sizeof(pow10) / sizeof(pow10[0]))
+
+void print_decimal(long v, unsigned char digits, unsigned char prec)
 {
-	/** Integer part from float number */
-	int integer;
-	/** Position counter for array limits */
-	int pos;
-	/** Size in bytes for the integer part */
-	int size;
-	/** Temporary pointer to the last position of #tx_data_raw */
-	char *c;
-	
-	memset(tx_data_raw, 0, TX_STR_SIZE);
-	
-	integer = f;
+	/** Magnitude of the number */
+	unsigned long u = (v < 0) ? -(unsigned long)v : (unsigned long)v;
+	/** Index in #pow10 of the digit being sent */
+	unsigned char i;
+	/** Index in #pow10 of the units digit */
+	unsigned char units;
+	/** Index in #pow10 of the last digit to be sent */
+	unsigned char last;
+	/** Digit being sent */
+	char d;
+	/** Decimal zeros waiting for a non-zero digit, -1 before the point */
+	signed char zeros = -1;
 	
-	/* snprintf(tx_data_raw, TX_STR_SIZE, "%d", integer); */
-	itoa(integer, tx_data_raw, 10);
+	if (digits > POW10_N - 1)
+		digits = POW10_N - 1;
+	if (prec > digits)
+		prec = digits;
+	units = POW10_N - 1 - digits;
+	last = units + prec;
 	
-	/* Fix subtraction for negative numbers */
-	if (f < 0) {
-		f *= -1;
-		integer *= -1;
-	}	
+	/* Round half away from zero to the last digit */
+	if (last < POW10_N - 1)
+		u += 5 * pow10[last + 1];
 	
-	/* Get the last position */
-	pos = strlen(tx_data_raw);
-	/* Store the current size */
-	size = pos;
+	/* No minus sign if it rounds to zero */
+	if ((v < 0) && (u >= pow10[last]))
+		send_char('-');
 	
-	tx_data_raw[pos++] = '.';
-	
-	while ((pos < size + FLT_DIG + 1) && (pos < TX_STR_SIZE)) {
-		f = f - (float) integer;
-		f *= (float) 10;
-		integer = (int) f;
-		c = &tx_data_raw[pos];
-		/* snprintf(c, 2, "%d", integer); */
-		itoa(integer, c, 10);
-		pos++;
-	}	
-	
-	send_string(tx_data_raw);
+	/*
+	 * Digits from the most significant one by repeated subtraction, so no
+	 * division is needed and they are sent as they are found
+	 */
+	for (i = 0; i <= last; i++) {
+		for (d = '0'; u >= pow10[i]; d++)
+			u -= pow10[i];
+		
+		if (i < units) {
+			/* Leading zeros */
+			if ((d != '0') || (zeros >= 0)) {
+				send_char(d);
+				zeros = 0;
+			}
+		} else if (i == units) {
+			send_char(d);
+			zeros = 0;
+		} else if (d == '0') {
+			/* Trailing zeros are only sent if a digit follows them */
+			zeros++;
+		} else {
+			if (i - units == zeros + 1)
+				send_char('.');
+			while (zeros) {
+				send_char('0');
+				zeros--;
+			}
+			send_char(d);
+		}
+	}
 }
 
-float parse_param(char c, float dft_ret)
+void print_fixed(long v)
+{
+	print_decimal(v, FIXED_DIGITS, REPORT_DIGITS);
+}
+
+void print_int(long v)
+{
+	print_decimal(v, 0, 0);
+}
+
+/**
+ * Word of each letter from 'A' to 'Z' (#word_id), -1 for the letters which are
+ * not used
+ */
+static const signed char word_of_letter[26] = {
+	-1, WORD_B, WORD_C, -1, WORD_E, WORD_F, WORD_G, -1, WORD_I, WORD_J, -1,
+	-1, WORD_M, -1, -1, -1, -1, WORD_R, WORD_S, -1, -1, -1, -1, WORD_X,
+	WORD_Y, WORD_Z
+};
+/** Decimal places of each word, indexed by #word_id */
+static const signed char word_digits[WORDS] = {
+	0, 0, FIXED_DIGITS, FIXED_DIGITS, FIXED_DIGITS, FIXED_DIGITS,
+	FIXED_DIGITS, FEED_DIGITS, FIXED_DIGITS, 0, FIXED_DIGITS, FIXED_DIGITS,
+	FIXED_DIGITS
+};
+
+/**
+ * @brief Parses a fixed-point number, see #parse_line.
+ * @param[in,out] str: first character of the number, set to the first one
+ * after it.
+ * @param[in] digits: decimal places, the result is the number times 10^digits.
+ * @param[out] v: the number.
+ * @return 0 on success, -1 if there is no number or it overflows.
+ */
+static signed char parse_number(const char **str, signed char digits, long *v)
 {
-	/** Pointer to buffer to be read. Used to parse arguments */
-	char *tmp_str = NULL;
-	/** Number found */
-	float num = 0;
-	/** Expoent */
-	float expo = 0;
-	/** Temporary counter */
-	int i = 0;
+	/** Character being parsed */
+	const char *p = *str;
+	/** Number found, scaled by 10^digits at the end */
+	long num = 0;
+	/** Decimal places read, -1 before the decimal point */
+	signed char dec = -1;
 	/** Used to flip the signal after the parsing */
 	char negative = 0;
+	/** Any digit was found? */
+	char found = 0;
 	
-	if (rx_data_raw[0] == '\0')
-		return dft_ret;
-	
-	/* Seek for the desired char */
-	tmp_str = strchr(rx_data_raw, c);
+	if (*p == '+') {
+		p++;
+	} else if (*p == '-') {
+		negative = 1;
+		p++;
+	}
 	
-	/* If the char was not found, return Not a Number as an error */
-	if (tmp_str == NULL)
-		return dft_ret;
-	/*
-	 * If the number was found, increment to advance to the next char after
-	 * its place.
-	 */
+	for (;; p++) {
+		if ((*p >= '0') && (*p <= '9')) {
+			found = 1;
+			/* Decimal places beyond the precision are ignored */
+			if (dec < digits) {
+				if (num > (PARAM_MAX - 9) / 10)
+					return -1;
+				num = 10*num + (*p - '0');
+				if (dec >= 0)
+					dec++;
+			}
+		} else if ((*p == '.') && (dec < 0)) {
+			dec = 0;
+		} else {
+			break;
+		}
+	}
 	
-	tmp_str++;
+	if (!found)
+		return -1;
 	
-	if (*tmp_str == '+') {
-		negative = 0;
-		tmp_str++;
-	} else if (*tmp_str == '-') {
-		negative = 1;
-		tmp_str++;
-	} else if (*tmp_str == '\0') {
-		return dft_ret;
+	/* Scale to the requested decimal places */
+	if (dec < 0)
+		dec = 0;
+	for (; dec < digits; dec++) {
+		if (num > PARAM_MAX / 10)
+			return -1;
+		num *= 10;
 	}
 	
-	/* If the number overflows or no number is read return an error */ 	
-	while ((*tmp_str) && (i < RX_STR_SIZE - 3)) {
-		if (isdigit(*tmp_str)) {
-			num = 10.0 * num + (float)(*tmp_str - '0');
-			expo *= 10.0;
-		} else if (*tmp_str == '.') {
-			expo = 1.0;
-		}else if(isspace(*tmp_str) || (*tmp_str == ';')
-			|| (*tmp_str == '*') || (*tmp_str == '(')) {
+	*str = p;
+	*v = negative ? -num : num;
+	return 0;
+}
+
+signed char parse_line(struct words *w)
+{
+	/** Character being parsed */
+	const char *p = rx_data_raw;
+	/** Word of the letter being parsed */
+	signed char id;
+	/** Number after the letter */
+	long v;
+	/** Letter being parsed */
+	char c;
+	
+	memset(w->at, 0, WORDS);
+	
+	while ((c = *p) != '\0') {
+		if ((c == ';') || (c == '*') || (c == '('))
 			break;
-		} else {
-			send_string("PARSE?\n");
-			memset(rx_data_raw, 0, RX_STR_SIZE);
-			return dft_ret;
+		
+		if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n')) {
+			p++;
+			continue;
 		}
-		tmp_str++;
-		i++;
+		
+		if ((c >= 'a') && (c <= 'z'))
+			c -= 'a' - 'A';
+		if ((c < 'A') || (c > 'Z'))
+			return -1;
+		
+		/* Unused letters are parsed as integers and discarded */
+		id = word_of_letter[c - 'A'];
+		p++;
+		if (id >= 0)
+			w->at[id] = p - rx_data_raw;
+		if (parse_number(&p, (id < 0) ? 0 : word_digits[id], &v))
+			return -1;
 	}
-	num = num / ((expo == 0.0) ? 1.0 : expo);
-	num = (negative ? -num : num);
 	
-	return num;
+	return 0;
+}
+
+long get_word(const struct words *w, char c, long dft_ret)
+{
+	/** Word of the letter */
+	signed char id;
+	/** Number of the word, checked by #parse_line */
+	const char *p;
+	/** Value of the word */
+	long v;
+	
+	if ((c < 'A') || (c > 'Z'))
+		return dft_ret;
+	
+	id = word_of_letter[c - 'A'];
+	if ((id < 0) || !w->at[id])
+		return dft_ret;
+	
+	p = rx_data_raw + w->at[id];
+	parse_number(&p, word_digits[id], &v);
+	return v;
 }
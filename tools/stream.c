@@ -0,0 +1,469 @@
+/**
+ * @file
+ * @brief Streams a G-code file to the controller through a serial port or the
+ * pseudo-terminal of the simulator (pnp_control_sim -p).
+ *
+ * Usage: pnp_control_stream [-d] [-b baud] [-t seconds] device file
+ *
+ * The comments and checksums are removed before sending, since the
+ * controller ends a line at ';' and '*' and would take the rest for another
+ * line, and each line is terminated by a null byte. A line which would not
+ * fit the line buffer of the controller (#RX_STR_SIZE) stops the tool before
+ * anything is sent. The echo is turned off (M13) and the lines are
+ * acknowledged with "ok" (M14): a line is sent as soon as the lines not
+ * acknowledged yet, the oldest one excluded, fit the receiver ring
+ * (#RX_CREDIT_BYTES), which keeps the planner queue full. With -d each line
+ * waits for the "done" of the previous one instead. Either acknowledgement
+ * counts, so the file may switch them with M14 and M15 too. At the end M15
+ * waits for the last moves and M12 turns the echo back on. XON/XOFF is obeyed.
+ *
+ * The lines per second and the time the link was idle while there were lines
+ * left are written to the standard error. The link is busy from each write
+ * for the time the bytes take at the given baud rate (which must be the
+ * controller one), so the idle time is the time the controller made the host
+ * wait.
+ * @author Davi Antônio da Silva Santos
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "sys_config.h"
+#include "usart.h"
+
+/** Seconds without any reply after which the tool gives up, by default */
+#define STREAM_TIMEOUT_S (120)
+/** Longest reply line kept, the rest is dropped */
+#define STREAM_REPLY_SIZE (128)
+/** Lines sent and not acknowledged yet, at most */
+#define STREAM_WINDOW (64)
+
+/**
+ * @brief One line ready to be sent.
+ */
+struct stream_line {
+	/** Bytes, the null terminator included */
+	char *data;
+	size_t len;
+};
+
+/** Serial port or pseudo-terminal */
+static int fd = -1;
+/** Seconds per character at the controller baud rate */
+static double char_time;
+/** Gives up after this many seconds without replies */
+static double timeout = STREAM_TIMEOUT_S;
+/** The controller sent XOFF */
+static char paused;
+/** Reply line being received */
+static char reply[STREAM_REPLY_SIZE];
+static size_t reply_len;
+/** Replies counted since the start */
+static unsigned long oks;
+static unsigned long dones;
+/** Time the last byte was received */
+static double last_rx;
+/** Time the bytes written so far are all sent */
+static double wire_free;
+
+/**
+ * @brief Reads the monotonic clock.
+ * @return Seconds.
+ */
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Opens the device in raw mode, 8N1 without flow control by the
+ * driver.
+ * @param[in] path: serial port or pseudo-terminal.
+ * @param[in] baud: baud rate.
+ * @return 0 on success, -1 on error.
+ */
+static int open_link(const char *path, unsigned long baud)
+{
+	/** Supported rates, the ones of M575 */
+	static const struct {
+		unsigned long baud;
+		speed_t speed;
+	} rates[] = {
+		{9600, B9600},
+		{19200, B19200},
+		{38400, B38400},
+		{57600, B57600},
+		{115200, B115200}
+	};
+	struct termios tio;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+		if (rates[i].baud == baud)
+			break;
+	if (i == sizeof(rates) / sizeof(rates[0])) {
+		fprintf(stderr, "unsupported baud rate %lu\n", baud);
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_NOCTTY);
+	if ((fd < 0) || tcgetattr(fd, &tio)) {
+		perror(path);
+		return -1;
+	}
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~CRTSCTS;
+	cfsetispeed(&tio, rates[i].speed);
+	cfsetospeed(&tio, rates[i].speed);
+	if (tcsetattr(fd, TCSANOW, &tio)) {
+		perror(path);
+		return -1;
+	}
+	tcflush(fd, TCIOFLUSH);
+
+	/* Start, 8 data and stop bits */
+	char_time = 10.0 / baud;
+
+	return 0;
+}
+
+/**
+ * @brief Reads the file, removing the comments, the checksums and the blank
+ * lines.
+ * @param[in] f: G-code file.
+ * @param[out] lines: lines read, to be freed by the caller.
+ * @param[out] count: number of lines.
+ * @return 0 on success, -1 if a line is too long or on error.
+ */
+static int load_lines(FILE *f, struct stream_line **lines, size_t *count)
+{
+	char buf[1024];
+	size_t len;
+	size_t size = 0;
+	unsigned long number = 0;
+	struct stream_line *l;
+
+	*lines = NULL;
+	*count = 0;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		number++;
+		len = strcspn(buf, ";*(\r\n");
+		while (len && ((buf[len - 1] == ' ') || (buf[len - 1] == '\t')))
+			len--;
+		if (!len)
+			continue;
+
+		/* The controller evaluates a full buffer as a line */
+		if (len > RX_STR_SIZE - 2) {
+			fprintf(stderr, "line %lu: %zu characters, %u at most\n",
+				number, len, RX_STR_SIZE - 2);
+			return -1;
+		}
+
+		if (*count == size) {
+			size = size ? 2 * size : 256;
+			l = realloc(*lines, size * sizeof(**lines));
+			if (!l) {
+				perror("realloc");
+				return -1;
+			}
+			*lines = l;
+		}
+
+		l = &(*lines)[*count];
+		l->len = len + 1;
+		l->data = malloc(l->len);
+		if (!l->data) {
+			perror("malloc");
+			return -1;
+		}
+		memcpy(l->data, buf, len);
+		l->data[len] = '\0';
+		(*count)++;
+	}
+
+	return ferror(f) ? -1 : 0;
+}
+
+/**
+ * @brief Writes bytes to the controller, accounting for the time they take.
+ * @param[in] data: bytes.
+ * @param[in] len: number of bytes.
+ * @param[in,out] idle: the time the link was idle before this write is added
+ * to it, NULL to ignore it.
+ * @return 0 on success, -1 on error.
+ */
+static int send_bytes(const char *data, size_t len, double *idle)
+{
+	double t = now_s();
+	ssize_t n;
+
+	if (t > wire_free) {
+		if (idle)
+			*idle += t - wire_free;
+		wire_free = t;
+	}
+	wire_free += len * char_time;
+
+	while (len) {
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Handles a complete reply line.
+ * @return 0 on success, -1 if the endstops stopped the machine.
+ */
+static int reply_line(void)
+{
+	reply[reply_len] = '\0';
+	reply_len = 0;
+
+	/* The echo of a line may come first, see read_line */
+	if (strstr(reply, "ok P")) {
+		oks++;
+		return 0;
+	}
+	if (strstr(reply, "done")) {
+		dones++;
+		return 0;
+	}
+
+	printf("%s\n", reply);
+	if (!strncmp(reply, "E H", 3)) {
+		fprintf(stderr, "endstop hit: %s\n", reply);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Waits for the replies of the controller.
+ * @param[in] wait: seconds to wait for the first byte, zero to only read what
+ * was already received.
+ * @return 0 on success, -1 on error or timeout.
+ */
+static int receive(double wait)
+{
+	struct pollfd p = {fd, POLLIN, 0};
+	char buf[256];
+	ssize_t n;
+	ssize_t i;
+	char c;
+	int r;
+
+	r = poll(&p, 1, (int)(wait * 1000));
+	if (r < 0) {
+		if (errno == EINTR)
+			return 0;
+		perror("poll");
+		return -1;
+	}
+	if (!r) {
+		if (now_s() - last_rx > timeout) {
+			fprintf(stderr, "no reply for %.0f s\n", timeout);
+			return -1;
+		}
+		return 0;
+	}
+
+	n = read(fd, buf, sizeof(buf));
+	if (n <= 0) {
+		perror("read");
+		return -1;
+	}
+	last_rx = now_s();
+
+	for (i = 0; i < n; i++) {
+		c = buf[i];
+		if (c == XOFF) {
+			paused = 1;
+		} else if (c == XON) {
+			paused = 0;
+		} else if (c == '\n') {
+			if (reply_line())
+				return -1;
+		} else if ((c != '\0') && (c != '\r')
+			   && (reply_len < sizeof(reply) - 1)) {
+			reply[reply_len++] = c;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Sends a command and waits for its reply.
+ * @param[in] cmd: command, without terminator.
+ * @param[in] ok: the reply is "ok", not "done".
+ * @return 0 on success, -1 on error or timeout.
+ */
+static int command(const char *cmd, char ok)
+{
+	unsigned long *count = ok ? &oks : &dones;
+	unsigned long expected = *count + 1;
+
+	while (paused)
+		if (receive(timeout))
+			return -1;
+	if (send_bytes(cmd, strlen(cmd) + 1, NULL))
+		return -1;
+	while (*count < expected)
+		if (receive(timeout))
+			return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Streams the lines and waits for the last reply.
+ * @param[in] lines: lines to be sent.
+ * @param[in] count: number of lines.
+ * @param[in] ok: the lines are acknowledged with "ok", otherwise each one
+ * waits for the "done" of the previous one.
+ * @param[out] idle: time the link was idle before the last line was sent.
+ * @param[out] sent: time the last line was sent.
+ * @return 0 on success, -1 on error or timeout.
+ */
+static int stream(const struct stream_line *lines, size_t count, char ok,
+		  double *idle, double *sent)
+{
+	/**
+	 * Replies counted before the first line: each line gets one "ok" or
+	 * one "done", depending on whether M14 or M15 is in effect, the M14
+	 * and M15 lines of the file included
+	 */
+	unsigned long base = oks + dones;
+	/** Lines acknowledged */
+	unsigned long acked = 0;
+	/** Next line to be sent */
+	size_t next = 0;
+	/** Bytes of the lines not acknowledged yet, the oldest one excluded */
+	size_t credit_used;
+	size_t i;
+
+	*idle = 0;
+	*sent = wire_free = now_s();
+
+	while (acked < count) {
+		acked = oks + dones - base;
+
+		credit_used = 0;
+		for (i = acked + 1; i < next; i++)
+			credit_used += lines[i].len;
+
+		if ((next < count) && !paused && ((acked == next)
+		    || (ok && (next - acked < STREAM_WINDOW)
+			&& (credit_used + lines[next].len <= RX_CREDIT_BYTES)))) {
+			if (send_bytes(lines[next].data, lines[next].len, idle))
+				return -1;
+			*sent = now_s();
+			next++;
+			if (receive(0))
+				return -1;
+		} else if ((acked < count) && receive(timeout)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	/** Controller baud rate */
+	unsigned long baud = UART_DEFAULT_BAUD;
+	/** Acknowledge with "ok", M14 */
+	char ok = 1;
+	FILE *f;
+	struct stream_line *lines;
+	size_t count;
+	double start;
+	/** Time the last line was sent */
+	double sent;
+	double end;
+	double idle;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "db:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			ok = 0;
+			break;
+		case 'b':
+			baud = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			timeout = strtod(optarg, NULL);
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (optind + 2 != argc) {
+		fprintf(stderr, "usage: %s [-d] [-b baud] [-t seconds] device "
+			"file\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	f = fopen(argv[optind + 1], "r");
+	if (!f) {
+		perror(argv[optind + 1]);
+		return EXIT_FAILURE;
+	}
+	ret = load_lines(f, &lines, &count);
+	fclose(f);
+	if (ret || open_link(argv[optind], baud))
+		return EXIT_FAILURE;
+
+	last_rx = now_s();
+	if (command("M13", 0) || (ok && command("M14", 1)))
+		return EXIT_FAILURE;
+
+	start = now_s();
+	if (stream(lines, count, ok, &idle, &sent))
+		return EXIT_FAILURE;
+
+	/* Performed after the queued moves */
+	if (ok && command("M15", 0))
+		return EXIT_FAILURE;
+	end = now_s();
+	if (command("M12", 0))
+		return EXIT_FAILURE;
+
+	fprintf(stderr, "%zu lines in %.3f s, %.1f lines/s\n", count,
+		end - start, (end > start) ? count / (end - start) : 0.0);
+	fprintf(stderr, "link idle %.3f s (%.1f%%) while streaming, last "
+		"moves %.3f s\n", idle,
+		(sent > start) ? 100 * idle / (sent - start) : 0.0,
+		end - sent);
+
+	return EXIT_SUCCESS;
+}